@@ -0,0 +1,10 @@
+# Turn a text file into a C header holding it as a string constant.
+#   cmake -DINPUT=<file> -DOUTPUT=<header> -DNAME=<symbol> -P embed.cmake
+file(READ ${INPUT} text)
+string(REPLACE "\\" "\\\\" text "${text}")
+string(REPLACE "\"" "\\\"" text "${text}")
+string(REPLACE "\n" "\\n\"\n    \"" text "${text}")
+file(WRITE ${OUTPUT}
+    "// Generated from ${INPUT}, do not edit\n"
+    "#pragma once\n\n"
+    "static const char ${NAME}[] =\n    \"${text}\";\n")
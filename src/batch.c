@@ -0,0 +1,250 @@
+#define _POSIX_C_SOURCE 200809L
+#include "batch.h"
+#include <dirent.h>
+#include <errno.h>
+#include <log/log.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "photomosaic.h"
+#include "util.h"
+
+#define BATCH_QUEUE 4  // Images in flight between two stages
+
+typedef struct {
+  char *input;
+  char *output;
+  unsigned char *image;  // NULL if decoding failed
+  int width;
+  int height;
+  int *indices;
+  double start;  // Decode start, for the per-image latency
+  double match_time;
+} BatchJob;
+
+typedef struct {
+  BatchJob *jobs[BATCH_QUEUE];
+  int head;
+  int count;
+  int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} JobQueue;
+
+static void queue_init(JobQueue *q) {
+  memset(q, 0, sizeof(*q));
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+}
+
+static void queue_destroy(JobQueue *q) {
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->not_empty);
+  pthread_cond_destroy(&q->not_full);
+}
+
+/**
+ * Append a job, blocking while the queue is full
+ */
+static void queue_push(JobQueue *q, BatchJob *job) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == BATCH_QUEUE) pthread_cond_wait(&q->not_full, &q->lock);
+  q->jobs[(q->head + q->count++) % BATCH_QUEUE] = job;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Take the oldest job, blocking while the queue is empty
+ * @return NULL once the queue is closed and drained
+ */
+static BatchJob *queue_pop(JobQueue *q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && !q->closed) pthread_cond_wait(&q->not_empty, &q->lock);
+  BatchJob *job = NULL;
+  if (q->count > 0) {
+    job = q->jobs[q->head];
+    q->head = (q->head + 1) % BATCH_QUEUE;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return job;
+}
+
+static void queue_close(JobQueue *q) {
+  pthread_mutex_lock(&q->lock);
+  q->closed = 1;
+  pthread_cond_broadcast(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+typedef struct {
+  BatchJob *jobs;
+  int num_jobs;
+  const Dataset *dataset;
+  JobQueue decoded;
+  JobQueue matched;
+  int num_failed;
+} Batch;
+
+static int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * List the inputs: the .bmp files of a directory in name order, or the lines of a manifest
+ * (blank lines and lines starting with '#' are skipped)
+ */
+static char **list_inputs(const char *input, int *count) {
+  int capacity = 64;
+  char **paths = (char **)malloc(capacity * sizeof(char *));
+  *count = 0;
+
+  struct stat st;
+  if (stat(input, &st) == 0 && S_ISDIR(st.st_mode)) {
+    DIR *dir = opendir(input);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+      size_t len = strlen(entry->d_name);
+      if (len < 4 || strcasecmp(entry->d_name + len - 4, ".bmp") != 0) continue;
+      if (*count == capacity) paths = (char **)realloc(paths, (capacity *= 2) * sizeof(char *));
+      paths[*count] = (char *)malloc(strlen(input) + len + 2);
+      sprintf(paths[(*count)++], "%s/%s", input, entry->d_name);
+    }
+    if (dir) closedir(dir);
+    qsort(paths, *count, sizeof(char *), compare_strings);
+    return paths;
+  }
+
+  FILE *manifest = fopen(input, "r");
+  if (!manifest) {
+    log_error("%s is neither a directory nor a readable manifest", input);
+    free(paths);
+    return NULL;
+  }
+  char line[4096];
+  while (fgets(line, sizeof(line), manifest)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#') continue;
+    if (*count == capacity) paths = (char **)realloc(paths, (capacity *= 2) * sizeof(char *));
+    paths[(*count)++] = strdup(line);
+  }
+  fclose(manifest);
+  return paths;
+}
+
+static void *decode_stage(void *arg) {
+  Batch *batch = (Batch *)arg;
+  for (int k = 0; k < batch->num_jobs; ++k) {
+    BatchJob *job = &batch->jobs[k];
+    job->start = timer_now();
+    int depth;
+    job->image = image_read(job->input, &job->width, &job->height, &depth);
+    queue_push(&batch->decoded, job);
+  }
+  queue_close(&batch->decoded);
+  return NULL;
+}
+
+static void *encode_stage(void *arg) {
+  Batch *batch = (Batch *)arg;
+  BatchJob *job;
+  while ((job = queue_pop(&batch->matched)) != NULL) {
+    if (job->image == NULL) {
+      batch->num_failed++;
+      log_error("[batch] %s failed", job->input);
+      continue;
+    }
+    if (image_write_mosaic(job->output, job->width, job->height, batch->dataset, job->indices)) {
+      batch->num_failed++;
+      log_error("[batch] %s failed", job->input);
+    } else {
+      log_info("[batch] %s: %dx%d, match %.1f ms, latency %.1f ms", job->input, job->width,
+               job->height, job->match_time * 1e3, (timer_now() - job->start) * 1e3);
+    }
+    free(job->image);
+    free(job->indices);
+    job->image = NULL;
+  }
+  return NULL;
+}
+
+int batch_run(const char *input, const char *output_dir, const Dataset *dataset) {
+  int num_inputs;
+  char **inputs = list_inputs(input, &num_inputs);
+  if (inputs == NULL) return EXIT_FAILURE;
+  if (num_inputs == 0) {
+    log_error("No input images in %s", input);
+    free(inputs);
+    return EXIT_FAILURE;
+  }
+  struct stat st;
+  if (mkdir(output_dir, 0755) != 0 &&
+      (errno != EEXIST || stat(output_dir, &st) != 0 || !S_ISDIR(st.st_mode))) {
+    log_error("Cannot create the output directory %s", output_dir);
+    for (int k = 0; k < num_inputs; ++k) free(inputs[k]);
+    free(inputs);
+    return EXIT_FAILURE;
+  }
+
+  log_use_mutex();  // The stages log from their own threads
+  Batch batch;
+  memset(&batch, 0, sizeof(batch));
+  batch.dataset = dataset;
+  batch.num_jobs = num_inputs;
+  batch.jobs = (BatchJob *)calloc(num_inputs, sizeof(BatchJob));
+  for (int k = 0; k < num_inputs; ++k) {
+    const char *name = strrchr(inputs[k], '/');
+    name = name ? name + 1 : inputs[k];
+    batch.jobs[k].input = inputs[k];
+    batch.jobs[k].output = (char *)malloc(strlen(output_dir) + strlen(name) + 2);
+    sprintf(batch.jobs[k].output, "%s/%s", output_dir, name);
+  }
+  queue_init(&batch.decoded);
+  queue_init(&batch.matched);
+  log_info("[batch] %d images from %s into %s", num_inputs, input, output_dir);
+
+  Photomosaic *mosaic = photomosaic_create(dataset);
+  double start = timer_now();
+  pthread_t decoder, encoder;
+  pthread_create(&decoder, NULL, decode_stage, &batch);
+  pthread_create(&encoder, NULL, encode_stage, &batch);
+
+  // Matching stays on this thread; it is the stage the others are sized around
+  BatchJob *job;
+  while ((job = queue_pop(&batch.decoded)) != NULL) {
+    if (job->image != NULL) {
+      double match_start = timer_now();
+      job->indices = (int *)malloc((job->width / 32) * (job->height / 32) * sizeof(int));
+      photomosaic_run(mosaic, job->image, job->width, job->height, job->indices);
+      job->match_time = timer_now() - match_start;
+    }
+    queue_push(&batch.matched, job);
+  }
+  queue_close(&batch.matched);
+  pthread_join(decoder, NULL);
+  pthread_join(encoder, NULL);
+  double elapsed = timer_now() - start;
+  photomosaic_destroy(mosaic);
+
+  int num_done = num_inputs - batch.num_failed;
+  log_info("[batch] %d of %d images in %.2f s, %.2f images/s", num_done, num_inputs, elapsed,
+           elapsed > 0 ? num_done / elapsed : 0.0);
+
+  queue_destroy(&batch.decoded);
+  queue_destroy(&batch.matched);
+  for (int k = 0; k < num_inputs; ++k) {
+    free(batch.jobs[k].input);
+    free(batch.jobs[k].output);
+  }
+  free(batch.jobs);
+  free(inputs);
+  return batch.num_failed == 0 ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "dataset.h"
+
+/**
+ * Build the mosaic of many images with one dataset and one warm matcher. Decoding, matching and
+ * encoding run on their own threads, connected by bounded queues, so that the matcher never
+ * waits on file I/O.
+ * @param input directory of .bmp files, or a manifest listing one input path per line
+ * @param output_dir directory receiving the mosaics under the input file names
+ * @return 0 if every image succeeded
+ */
+int batch_run(const char *input, const char *output_dir, const Dataset *dataset);
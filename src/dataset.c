@@ -0,0 +1,366 @@
+#define _POSIX_C_SOURCE 200809L
+#include "dataset.h"
+#include <fcntl.h>
+#include <log/log.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define W 32
+#define H 32
+#define C 3
+#define TILE_LEN (W * H * C)
+
+static void compute_sections(Dataset *dataset) {
+  int *sq_norms = (int *)malloc(dataset->count * sizeof(int));
+  int *sums = (int *)malloc(dataset->count * C * sizeof(int));
+  unsigned short *thumbs =
+      (unsigned short *)calloc((size_t)dataset->count * THUMB_LEN, sizeof(unsigned short));
+  int bh = H / THUMB_H, bw = W / THUMB_W;
+
+  for (int i = 0; i < dataset->count; ++i) {
+    const unsigned char *tile = dataset->tiles + (size_t)i * TILE_LEN;
+    unsigned short *thumb = thumbs + (size_t)i * THUMB_LEN;
+    int sq = 0;
+    for (int c = 0; c < C; ++c) {
+      int sum = 0;
+      for (int h = 0; h < H; ++h) {
+        for (int w = 0; w < W; ++w) {
+          int v = tile[(c * H + h) * W + w];
+          sum += v;
+          sq += v * v;
+          thumb[(c * THUMB_H + h / bh) * THUMB_W + w / bw] += v;
+        }
+      }
+      sums[i * C + c] = sum;
+    }
+    sq_norms[i] = sq;
+  }
+
+  dataset->sq_norms = sq_norms;
+  dataset->sums = sums;
+  dataset->thumbs = thumbs;
+  dataset->heap[1] = sq_norms;
+  dataset->heap[2] = sums;
+  dataset->heap[3] = thumbs;
+}
+
+/**
+ * Use a raw dump already in memory in place; only the derived sections are allocated
+ */
+static Dataset *wrap_raw(const unsigned char *tiles, size_t size) {
+  Dataset *dataset = (Dataset *)calloc(1, sizeof(Dataset));
+  dataset->count = size / TILE_LEN;
+  dataset->tiles = tiles;
+  compute_sections(dataset);
+  return dataset;
+}
+
+static Dataset *load_raw(const char *path, FILE *fin) {
+  fseek(fin, 0, SEEK_END);
+  long size = ftell(fin);
+  rewind(fin);
+
+  Dataset *dataset = (Dataset *)calloc(1, sizeof(Dataset));
+  dataset->count = size / TILE_LEN;
+  unsigned char *tiles = (unsigned char *)malloc((size_t)dataset->count * TILE_LEN);
+  if (fread(tiles, TILE_LEN, dataset->count, fin) != dataset->count) {
+    log_error("Failed to read %s", path);
+    exit(EXIT_FAILURE);
+  }
+  dataset->tiles = tiles;
+  dataset->heap[0] = tiles;
+  compute_sections(dataset);
+  return dataset;
+}
+
+static const void *require_section(const Dataset *dataset, uint32_t tag, size_t size) {
+  size_t actual;
+  const void *data = dataset_section(dataset, tag, &actual);
+  if (data == NULL || actual != size) {
+    log_error("Index section %u is missing or has a wrong size", tag);
+    exit(EXIT_FAILURE);
+  }
+  return data;
+}
+
+/**
+ * Exit unless header describes an index this build can read from a file of size bytes
+ */
+static void check_header(const char *path, const IndexHeader *header, size_t size) {
+  if (size < sizeof(IndexHeader)) {
+    log_error("%s: index header is truncated", path);
+    exit(EXIT_FAILURE);
+  }
+  if (header->version != INDEX_VERSION) {
+    log_error("%s: unsupported index version %u", path, header->version);
+    exit(EXIT_FAILURE);
+  }
+  if (header->tile_len != TILE_LEN) {
+    log_error("%s: index holds tiles of %u bytes, expected %d", path, header->tile_len, TILE_LEN);
+    exit(EXIT_FAILURE);
+  }
+  if (header->num_sections > INDEX_MAX_SECTIONS) {
+    log_error("%s: index has %u sections, at most %d are supported", path, header->num_sections,
+              INDEX_MAX_SECTIONS);
+    exit(EXIT_FAILURE);
+  }
+  for (int s = 0; s < header->num_sections; ++s) {
+    if (header->sections[s].offset + header->sections[s].size > size) {
+      log_error("%s: section %u is truncated", path, header->sections[s].tag);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/**
+ * Validate an index file image and point the dataset sections into it
+ */
+static Dataset *parse_index(const char *path, const void *data, size_t size) {
+  const IndexHeader *header = (const IndexHeader *)data;
+  check_header(path, header, size);
+
+  Dataset *dataset = (Dataset *)calloc(1, sizeof(Dataset));
+  dataset->header = header;
+  dataset->count = header->count;
+  size_t count = dataset->count;
+  dataset->tiles = require_section(dataset, SECTION_TILES, count * TILE_LEN);
+  dataset->sq_norms = require_section(dataset, SECTION_SQ_NORMS, count * sizeof(int));
+  dataset->sums = require_section(dataset, SECTION_SUMS, count * C * sizeof(int));
+  dataset->thumbs =
+      require_section(dataset, SECTION_THUMBS, count * THUMB_LEN * sizeof(unsigned short));
+  return dataset;
+}
+
+static Dataset *map_index(const char *path, int fd, size_t size) {
+  void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    log_error("Failed to map %s", path);
+    exit(EXIT_FAILURE);
+  }
+  Dataset *dataset = parse_index(path, map, size);
+  dataset->map = map;
+  dataset->map_size = size;
+  return dataset;
+}
+
+Dataset *dataset_open(const char *path) {
+  FILE *fin = fopen(path, "rb");
+  if (!fin) {
+    log_error("%s not found", path);
+    exit(EXIT_FAILURE);
+  }
+
+  char magic[8] = {0};
+  fread(magic, 1, sizeof(magic), fin);
+  if (memcmp(magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+    log_warn("%s is not an index; computing norms and thumbnails in memory", path);
+    Dataset *dataset = load_raw(path, fin);
+    fclose(fin);
+    return dataset;
+  }
+
+  struct stat st;
+  fstat(fileno(fin), &st);
+  Dataset *dataset = map_index(path, fileno(fin), st.st_size);
+  fclose(fin);
+  return dataset;
+}
+
+Dataset *dataset_open_memory(const char *path, const void *data, size_t size) {
+  if (size < sizeof(IndexHeader) || memcmp(data, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+    log_warn("%s is not an index; computing norms and thumbnails in memory", path);
+    return wrap_raw((const unsigned char *)data, size);
+  }
+  return parse_index(path, data, size);
+}
+
+Dataset *dataset_open_streamed(const char *path) {
+  FILE *fin = fopen(path, "rb");
+  if (!fin) {
+    log_error("%s not found", path);
+    exit(EXIT_FAILURE);
+  }
+
+  Dataset *dataset = (Dataset *)calloc(1, sizeof(Dataset));
+  dataset->file = fin;
+  IndexHeader header;
+  memset(&header, 0, sizeof(header));
+  fread(&header, 1, sizeof(header), fin);
+  fseeko(fin, 0, SEEK_END);
+  off_t size = ftello(fin);
+  if (memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+    dataset->count = size / TILE_LEN;
+    dataset->tiles_offset = 0;
+    return dataset;
+  }
+
+  check_header(path, &header, size);
+  for (int s = 0; s < header.num_sections; ++s) {
+    if (header.sections[s].tag == SECTION_TILES) {
+      dataset->count = header.count;
+      dataset->tiles_offset = header.sections[s].offset;
+      return dataset;
+    }
+  }
+  log_error("%s: index has no tiles section", path);
+  exit(EXIT_FAILURE);
+}
+
+void dataset_read_tiles(const Dataset *dataset, int begin, int count, unsigned char *out) {
+  size_t size = (size_t)count * TILE_LEN;
+  off_t offset = dataset->tiles_offset + (off_t)begin * TILE_LEN;
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pread(fileno(dataset->file), out + done, size - done, offset + done);
+    if (n <= 0) {
+      log_error("Failed to read images %d to %d of the dataset", begin, begin + count);
+      exit(EXIT_FAILURE);
+    }
+    done += n;
+  }
+}
+
+struct DatasetStream {
+  const Dataset *dataset;
+  int chunk_size;
+  unsigned char *buffers[2];
+  int current;       // Buffer the pending read fills
+  int next_begin;    // First image of the pending read
+  int next_count;    // Images in the pending read, 0 when the dataset is exhausted
+  pthread_t reader;
+  int reading;
+};
+
+static void *read_chunk(void *arg) {
+  DatasetStream *stream = (DatasetStream *)arg;
+  dataset_read_tiles(stream->dataset, stream->next_begin, stream->next_count,
+                     stream->buffers[stream->current]);
+  return NULL;
+}
+
+/**
+ * Start reading the chunk at begin into the current buffer in the background
+ */
+static void prefetch_chunk(DatasetStream *stream, int begin) {
+  int left = stream->dataset->count - begin;
+  stream->next_begin = begin;
+  stream->next_count = left < stream->chunk_size ? left : stream->chunk_size;
+  stream->reading = stream->next_count > 0;
+  if (stream->reading && pthread_create(&stream->reader, NULL, read_chunk, stream) != 0) {
+    // Fall back to a synchronous read
+    stream->reading = 0;
+    read_chunk(stream);
+  }
+}
+
+DatasetStream *dataset_stream_begin(const Dataset *dataset, int chunk_size) {
+  DatasetStream *stream = (DatasetStream *)calloc(1, sizeof(DatasetStream));
+  stream->dataset = dataset;
+  stream->chunk_size = chunk_size;
+  for (int b = 0; b < 2; ++b) {
+    stream->buffers[b] = (unsigned char *)malloc((size_t)chunk_size * TILE_LEN);
+  }
+  prefetch_chunk(stream, 0);
+  return stream;
+}
+
+int dataset_stream_next(DatasetStream *stream, const unsigned char **tiles, int *begin) {
+  if (stream->reading) pthread_join(stream->reader, NULL);
+  stream->reading = 0;
+  int count = stream->next_count;
+  if (count == 0) return 0;
+  *tiles = stream->buffers[stream->current];
+  *begin = stream->next_begin;
+  stream->current ^= 1;
+  prefetch_chunk(stream, *begin + count);
+  return count;
+}
+
+void dataset_stream_end(DatasetStream *stream) {
+  if (stream->reading) pthread_join(stream->reader, NULL);
+  free(stream->buffers[0]);
+  free(stream->buffers[1]);
+  free(stream);
+}
+
+void dataset_close(Dataset *dataset) {
+  if (dataset->file) fclose(dataset->file);
+  if (dataset->map) munmap(dataset->map, dataset->map_size);
+  for (int k = 0; k < sizeof(dataset->heap) / sizeof(dataset->heap[0]); ++k) {
+    free(dataset->heap[k]);
+  }
+  free(dataset);
+}
+
+const void *dataset_section(const Dataset *dataset, uint32_t tag, size_t *size) {
+  if (dataset->header == NULL) return NULL;
+  for (int s = 0; s < dataset->header->num_sections; ++s) {
+    const IndexSection *section = &dataset->header->sections[s];
+    if (section->tag == tag) {
+      if (size) *size = section->size;
+      return (const char *)dataset->header + section->offset;
+    }
+  }
+  return NULL;
+}
+
+int dataset_write_index(const Dataset *dataset, const char *path, const IndexPayload *extra,
+                        int num_extra) {
+  size_t count = dataset->count;
+  IndexPayload payloads[INDEX_MAX_SECTIONS] = {
+      {SECTION_TILES, dataset->tiles, count * TILE_LEN},
+      {SECTION_SQ_NORMS, dataset->sq_norms, count * sizeof(int)},
+      {SECTION_SUMS, dataset->sums, count * C * sizeof(int)},
+      {SECTION_THUMBS, dataset->thumbs, count * THUMB_LEN * sizeof(unsigned short)},
+  };
+  int num_payloads = 4;
+  if (num_payloads + num_extra > INDEX_MAX_SECTIONS) {
+    log_error("Too many index sections");
+    return -1;
+  }
+  memcpy(payloads + num_payloads, extra, num_extra * sizeof(IndexPayload));
+  num_payloads += num_extra;
+
+  IndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  header.version = INDEX_VERSION;
+  header.tile_len = TILE_LEN;
+  header.count = count;
+  header.num_sections = num_payloads;
+  uint64_t offset = (sizeof(IndexHeader) + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+  for (int s = 0; s < num_payloads; ++s) {
+    header.sections[s].tag = payloads[s].tag;
+    header.sections[s].offset = offset;
+    header.sections[s].size = payloads[s].size;
+    offset += (payloads[s].size + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+  }
+
+  FILE *fout = fopen(path, "wb");
+  if (!fout) {
+    log_error("Failed to open %s", path);
+    return -1;
+  }
+  fwrite(&header, sizeof(header), 1, fout);
+  for (int s = 0; s < num_payloads; ++s) {
+    fseeko(fout, header.sections[s].offset, SEEK_SET);
+    if (fwrite(payloads[s].data, 1, payloads[s].size, fout) != payloads[s].size) {
+      log_error("Failed to write %s", path);
+      fclose(fout);
+      return -1;
+    }
+  }
+  // Pad the last section so the file length is page aligned as well
+  const IndexSection *last = &header.sections[num_payloads - 1];
+  if (offset > last->offset + last->size) {
+    fseeko(fout, offset - 1, SEEK_SET);
+    fputc(0, fout);
+  }
+  fclose(fout);
+  return 0;
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Dataset index file
+ *
+ * A versioned file made of a fixed header followed by page-aligned sections, so that the whole
+ * file can be mapped read-only and every section used in place. Header and sections are in the
+ * byte order of the machine that built it, so an index is only portable between machines of the
+ * same endianness. Build one from the raw CIFAR-10 dump with the build_index tool.
+ */
+
+#define INDEX_MAGIC "PMOSAIC"
+#define INDEX_VERSION 1
+#define INDEX_ALIGN 4096
+#define INDEX_MAX_SECTIONS 32
+
+#define THUMB_W 8
+#define THUMB_H 8
+#define THUMB_LEN (THUMB_W * THUMB_H * 3)
+
+enum {
+  SECTION_TILES = 1,  // count x TILE_LEN bytes, CHW
+  SECTION_SQ_NORMS,   // count x int32, squared L2 norm of each tile
+  SECTION_SUMS,       // count x 3 int32, channel sums (mean colour times 1024)
+  SECTION_THUMBS,     // count x THUMB_LEN uint16, CHW 8x8 thumbnails holding 4x4 block sums
+
+  // Optional sections written by build_index on request
+  SECTION_IVF_CENTROIDS = 16,  // nlist x TILE_LEN bytes, k-means centroids
+  SECTION_IVF_OFFSETS,         // (nlist + 1) x int32, start of each list in SECTION_IVF_IDS
+  SECTION_IVF_IDS,             // count x int32, image indices grouped by list
+
+  SECTION_PQ_CODEBOOKS = 32,  // m x 256 x (TILE_LEN / m) bytes, k-means codebook per subvector
+  SECTION_PQ_CODES,           // count x m bytes, nearest centroid of each subvector
+
+  SECTION_VPT_NODES = 48,  // num_nodes x VPNode, node 0 is the root
+  SECTION_VPT_IDS,         // count x int32, image indices, each leaf a contiguous range
+
+  SECTION_PCA_MEAN = 64,  // TILE_LEN floats, mean tile
+  SECTION_PCA_BASIS,      // dims x TILE_LEN floats, orthonormal principal components
+  SECTION_PCA_COORDS,     // count x dims floats, projection of each centred tile
+
+  SECTION_SOA_TILES = 80,  // SECTION_TILES interleaved SOA_LANES candidates at a time, see soa.h
+};
+
+/**
+ * Vantage-point tree node. An inner node splits the images of its subtree, minus the vantage
+ * point itself, at the median SSD to the vantage point; lo and hi keep the SSD range of each half
+ * so the search can bound the distance to every image below a child.
+ */
+typedef struct {
+  int32_t vp;           // vantage point image index, -1 for a leaf
+  int32_t child[2];     // nearer and farther half
+  int32_t lo[2], hi[2];
+  int32_t begin, end;  // leaf range in SECTION_VPT_IDS
+} VPNode;
+
+typedef struct {
+  uint32_t tag;
+  uint32_t reserved;
+  uint64_t offset;
+  uint64_t size;
+} IndexSection;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t tile_len;
+  uint64_t count;
+  uint32_t num_sections;
+  uint32_t reserved;
+  IndexSection sections[INDEX_MAX_SECTIONS];
+} IndexHeader;
+
+/**
+ * Section payload handed to dataset_write_index()
+ */
+typedef struct {
+  uint32_t tag;
+  const void *data;
+  size_t size;
+} IndexPayload;
+
+typedef struct {
+  int count;
+  const unsigned char *tiles;
+  const int *sq_norms;
+  const int *sums;
+  const unsigned short *thumbs;
+
+  const IndexHeader *header;  // NULL when loaded from a raw dump
+  void *map;                  // Mapping of the index file, NULL if the caller owns the memory
+  size_t map_size;
+  void *heap[4];
+
+  FILE *file;             // Open only for streamed datasets, whose tiles stay on disk
+  uint64_t tiles_offset;  // Byte offset of the first tile in file
+} Dataset;
+
+typedef struct DatasetStream DatasetStream;
+
+/**
+ * Open an index file with mmap, or load a raw CIFAR-10 dump and compute the derived sections
+ * in memory. Exits on failure.
+ */
+Dataset *dataset_open(const char *path);
+void dataset_close(Dataset *dataset);
+
+/**
+ * Same as dataset_open() over the contents of the file already in memory, e.g. shared between
+ * processes. data is used in place and must outlive the dataset.
+ * @param path only names the dataset in messages
+ */
+Dataset *dataset_open_memory(const char *path, const void *data, size_t size);
+
+/**
+ * Open an index or raw dump without loading it. Only count and the file are set; tiles and the
+ * derived sections are NULL and the tiles are read with dataset_read_tiles() or a stream.
+ */
+Dataset *dataset_open_streamed(const char *path);
+
+/**
+ * Read count tiles starting at image begin from a streamed dataset
+ */
+void dataset_read_tiles(const Dataset *dataset, int begin, int count, unsigned char *out);
+
+/**
+ * Walk a streamed dataset chunk_size images at a time. Two chunk buffers are kept, and the next
+ * chunk is read by a background thread while the caller works on the current one.
+ */
+DatasetStream *dataset_stream_begin(const Dataset *dataset, int chunk_size);
+
+/**
+ * Wait for the next chunk and start prefetching the one after it. The chunk stays valid until
+ * the following call.
+ * @param begin set to the index of the first image in the chunk
+ * @return number of images in the chunk, 0 at the end of the dataset
+ */
+int dataset_stream_next(DatasetStream *stream, const unsigned char **tiles, int *begin);
+void dataset_stream_end(DatasetStream *stream);
+
+/**
+ * Look up an optional section of a mapped index
+ * @return NULL if the section is absent or the dataset was loaded from a raw dump
+ */
+const void *dataset_section(const Dataset *dataset, uint32_t tag, size_t *size);
+
+/**
+ * Write the core sections of dataset followed by extra payloads
+ * @return 0 on success
+ */
+int dataset_write_index(const Dataset *dataset, const char *path, const IndexPayload *extra,
+                        int num_extra);
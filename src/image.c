@@ -0,0 +1,108 @@
+#include "image.h"
+#include <log/log.h>
+#include <pthread.h>
+#include <qdbmp/qdbmp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define W 32
+#define H 32
+#define C 3
+#define TILE_LEN (W * H * C)
+
+// qdbmp keeps its last error in a static, so one BMP call sequence runs at a time across the
+// batch and server threads
+static pthread_mutex_t bmp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned char *image_read(const char *path, int *width, int *height, int *depth) {
+  pthread_mutex_lock(&bmp_lock);
+  BMP *bmp = BMP_ReadFile(path);
+  if (bmp == NULL) {
+    log_error("%s: %s", path, BMP_GetErrorDescription());
+    pthread_mutex_unlock(&bmp_lock);
+    return NULL;
+  }
+
+  *width = BMP_GetWidth(bmp);
+  *height = BMP_GetHeight(bmp);
+  *depth = BMP_GetDepth(bmp);
+  if (*width % W != 0 || *height % H != 0) {
+    log_error("width and height should be multiple of 32.");
+    BMP_Free(bmp);
+    pthread_mutex_unlock(&bmp_lock);
+    return NULL;
+  }
+  if (*depth != 24) {
+    log_error("depth should be 24.");
+    BMP_Free(bmp);
+    pthread_mutex_unlock(&bmp_lock);
+    return NULL;
+  }
+
+  unsigned char *img = (unsigned char *)malloc((size_t)*height * *width * C);
+  unsigned char *it = img;
+  for (int i = 0; i < *height; ++i) {
+    for (int j = 0; j < *width; ++j) {
+      BMP_GetPixelRGB(bmp, j, i, it, it + 1, it + 2);
+      it += 3;
+    }
+  }
+  BMP_Free(bmp);
+  pthread_mutex_unlock(&bmp_lock);
+  return img;
+}
+
+void image_compose(const Dataset *dataset, const int *indices, int width, int height,
+                   unsigned char *rgb) {
+  int seg_height = height / H;
+  int seg_width = width / W;
+  unsigned char chosen[TILE_LEN];
+  for (int sh = 0; sh < seg_height; ++sh) {
+    for (int sw = 0; sw < seg_width; ++sw) {
+      int index = indices[sh * seg_width + sw];
+      const unsigned char *tile = dataset->tiles + (size_t)index * TILE_LEN;
+      if (dataset->tiles == NULL) {
+        // Streamed datasets only read back the chosen images
+        dataset_read_tiles(dataset, index, 1, chosen);
+        tile = chosen;
+      }
+      for (int h = 0; h < H; ++h) {
+        for (int w = 0; w < W; ++w) {
+          for (int c = 0; c < C; ++c) {
+            rgb[((size_t)(sh * H + h) * width + sw * W + w) * C + c] = tile[(c * H + h) * W + w];
+          }
+        }
+      }
+    }
+  }
+}
+
+int image_write(const char *path, int width, int height, const unsigned char *rgb) {
+  pthread_mutex_lock(&bmp_lock);
+  BMP *bmp = BMP_Create(width, height, 24);
+  const unsigned char *it = rgb;
+  for (int i = 0; i < height; ++i) {
+    for (int j = 0; j < width; ++j) {
+      BMP_SetPixelRGB(bmp, j, i, it[0], it[1], it[2]);
+      it += 3;
+    }
+  }
+  BMP_WriteFile(bmp, path);
+  int failed = BMP_GetError() != BMP_OK;
+  if (failed) log_error("%s: %s", path, BMP_GetErrorDescription());
+  BMP_Free(bmp);
+  pthread_mutex_unlock(&bmp_lock);
+  if (failed) return -1;
+  log_debug("Image saved to %s", path);
+  return 0;
+}
+
+int image_write_mosaic(const char *path, int width, int height, const Dataset *dataset,
+                       const int *indices) {
+  log_debug("Constructing and saving tiled image..");
+  unsigned char *rgb = (unsigned char *)malloc((size_t)width * height * C);
+  image_compose(dataset, indices, width, height, rgb);
+  int status = image_write(path, width, height, rgb);
+  free(rgb);
+  return status;
+}
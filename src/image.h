@@ -0,0 +1,29 @@
+#pragma once
+
+#include "dataset.h"
+
+/**
+ * Read a 24-bit BMP whose sides are multiples of 32 into an HWC RGB buffer
+ * @return NULL after logging the reason if the file cannot be used
+ */
+unsigned char *image_read(const char *path, int *width, int *height, int *depth);
+
+/**
+ * Write an HWC RGB buffer as a 24-bit BMP
+ * @return 0 on success
+ */
+int image_write(const char *path, int width, int height, const unsigned char *rgb);
+
+/**
+ * Render the mosaic made of the images chosen for every tile into an HWC RGB buffer of
+ * width x height pixels. Streamed datasets only read back the chosen images.
+ */
+void image_compose(const Dataset *dataset, const int *indices, int width, int height,
+                   unsigned char *rgb);
+
+/**
+ * Compose the mosaic and write it as a BMP
+ * @return 0 on success, as image_write()
+ */
+int image_write_mosaic(const char *path, int width, int height, const Dataset *dataset,
+                       const int *indices);
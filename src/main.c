@@ -1,13 +1,17 @@
 #include <log/log.h>
-#include <qdbmp/qdbmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include "batch.h"
+#include "image.h"
+#include "options.h"
 #include "photomosaic.h"
+#include "server/server.h"
 #include "util.h"
 
 #ifdef _MC_MPI
 #include <mpi.h>
+#include "mpi/distribute.h"
 #endif
 
 void print_cwd() {
@@ -16,95 +20,93 @@ void print_cwd() {
   log_debug("Current working directory: %s", buf);
 }
 
-void save_nchw_tiling(const char *filename, int width, int height, unsigned char *nchw_images,
-                      int *indices) {
-  log_debug("Constructing and saving tiled image..");
-  int seg_height = height / 32;
-  int seg_width = width / 32;
-  BMP *bmp = BMP_Create(width, height, 24);
-  for (int sh = 0; sh < seg_height; ++sh) {
-    for (int sw = 0; sw < seg_width; ++sw) {
-      int index = indices[sh * seg_width + sw];
-      for (int h = 0; h < 32; ++h) {
-        for (int w = 0; w < 32; ++w) {
-          unsigned char rgb[3];
-          for (int c = 0; c < 3; ++c) {
-            rgb[c] = nchw_images[((index * 3 + c) * 32 + h) * 32 + w];
-          }
-          BMP_SetPixelRGB(bmp, sw * 32 + w, sh * 32 + h, rgb[0], rgb[1], rgb[2]);
-        }
-      }
-    }
+static Dataset *open_dataset() {
+  const char *dataset_path = options.dataset;
+  if (dataset_path == NULL) {
+    dataset_path = access(DEFAULT_INDEX, R_OK) == 0 ? DEFAULT_INDEX : DEFAULT_RAW;
   }
-  BMP_WriteFile(bmp, filename);
-  log_debug("Image saved to %s", filename);
-  BMP_Free(bmp);
+  timer_start();
+#ifdef _MC_MPI
+  Dataset *dataset = mpi_dataset_open(dataset_path);
+#else
+  Dataset *dataset = options.stream_chunk > 0 ? dataset_open_streamed(dataset_path)
+                                              : dataset_open(dataset_path);
+#endif
+  log_debug("dataset read success: %d images from %s", dataset->count, dataset_path);
+  timer_stop_and_log("dataset load time");
+  return dataset;
 }
 
 int main(int argc, char **argv) {
-  if (argc != 3) {
-    log_error("Usage: %s [input.bmp] [output.bmp]", argv[0]);
+  int argi = parse_options(argc, argv);
+  if (argc - argi != (options.socket ? 0 : 2)) {
+    print_usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  const char *input_path = options.socket ? NULL : argv[argi];
+  const char *output_path = options.socket ? NULL : argv[argi + 1];
+#ifdef _MC_OPENCL
+  if (options.stream_chunk > 0) {
+    log_error("Streaming the dataset (-m) is only supported by the omp target");
     exit(EXIT_FAILURE);
   }
+#endif
 
 #ifdef _MC_MPI
+  if (options.batch || options.socket) {
+    log_error("Batch (-B) and server (-S) modes are not supported by the MPI targets");
+    exit(EXIT_FAILURE);
+  }
+  if (options.stream_chunk > 0) {
+    log_error("Streaming the dataset (-m) is not supported by the MPI targets");
+    exit(EXIT_FAILURE);
+  }
   MPI_Init(&argc, &argv);
 
   int world_size;
   int world_rank;
   MPI_Comm_size(MPI_COMM_WORLD, &world_size);
   MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+#else
+  if (options.socket) {
+    Dataset *dataset = open_dataset();
+    int status = server_run(options.socket, dataset);
+    dataset_close(dataset);
+    return status;
+  }
+  if (options.batch) {
+    Dataset *dataset = open_dataset();
+    int status = batch_run(input_path, output_path, dataset);
+    dataset_close(dataset);
+    return status;
+  }
 #endif
 
   // Read image
 
-  BMP *bmp = BMP_ReadFile(argv[1]);
-  BMP_CHECK_ERROR(stderr, EXIT_FAILURE);
-
-  int width = BMP_GetWidth(bmp);
-  int height = BMP_GetHeight(bmp);
-  int depth = BMP_GetDepth(bmp);
+  int width, height, depth;
+#ifdef _MC_MPI
+  // Only rank 0 holds the pixels; photomosaic_mpi() sends each rank what it needs
+  unsigned char *img;
+  if (mpi_image_read(input_path, &img, &width, &height, &depth) != 0) exit(EXIT_FAILURE);
+#else
+  unsigned char *img = image_read(input_path, &width, &height, &depth);
+  if (img == NULL) exit(EXIT_FAILURE);
+#endif
 #ifdef _MC_MPI
   if (world_rank == 0) {
 #endif
-    log_debug("Input image %s", argv[1]);
+    log_debug("Input image %s", input_path);
     log_debug("  width: %d", width);
     log_debug("  height: %d", height);
     log_debug("  depth: %d", depth);
 #ifdef _MC_MPI
   }
 #endif
-  if (width % 32 != 0 || height % 32 != 0) {
-    log_error("width and height should be multiple of 32.");
-    exit(EXIT_FAILURE);
-  }
-  if (depth != 24) {
-    log_error("depth should be 24.");
-    exit(EXIT_FAILURE);
-  }
-
-  unsigned char *img = (unsigned char *)malloc(height * width * 3);
-  unsigned char *it = img;
-  for (int i = 0; i < height; ++i) {
-    for (int j = 0; j < width; ++j) {
-      BMP_GetPixelRGB(bmp, j, i, it, it + 1, it + 2);
-      it += 3;
-    }
-  }
-  BMP_Free(bmp);
 
   // Read dataset
 
-  unsigned char *dataset = (unsigned char *)malloc(60000 * 3 * 32 * 32);
-  FILE *fin = fopen("data/cifar-10.bin", "rb");
-  if (!fin) {
-    log_error("cifar-10.bin not found");
-    exit(EXIT_FAILURE);
-  }
-  fread(dataset, 1, 60000 * 3 * 32 * 32, fin);
-  fclose(fin);
-
-  log_debug("dataset read success");
+  Dataset *dataset = open_dataset();
 
   // Computation
 
@@ -121,23 +123,25 @@ int main(int argc, char **argv) {
   timer_stop_and_log("Total elapsed");
 #endif
 
+  int status = 0;
 #ifdef _MC_MPI
-  if (world_rank == 0) save_nchw_tiling(argv[2], width, height, dataset, indices);
+  if (world_rank == 0) status = image_write_mosaic(output_path, width, height, dataset, indices);
 #else
   // Write result
-  save_nchw_tiling(argv[2], width, height, dataset, indices);
+  status = image_write_mosaic(output_path, width, height, dataset, indices);
 #endif
 
   // Free resources
 
   free(img);
-  free(dataset);
 #ifdef _MC_MPI
+  mpi_dataset_close(dataset);
   if (world_rank == 0) free(indices);
   MPI_Finalize();
 #else
+  dataset_close(dataset);
   free(indices);
 #endif
 
-  return 0;
+  return status == 0 ? 0 : EXIT_FAILURE;
 }
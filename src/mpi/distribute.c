@@ -0,0 +1,143 @@
+#define _POSIX_C_SOURCE 200809L
+#include "distribute.h"
+#include <image.h>
+#include <log/log.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define H 32
+#define C 3
+#define BCAST_CHUNK (1 << 30)  // Bytes per MPI_Bcast, whose count is an int
+
+static MPI_Win dataset_win = MPI_WIN_NULL;
+
+static void bcast_bytes(void *data, size_t size, MPI_Comm comm) {
+  for (size_t offset = 0; offset < size; offset += BCAST_CHUNK) {
+    int count = size - offset < BCAST_CHUNK ? (int)(size - offset) : BCAST_CHUNK;
+    MPI_Bcast((char *)data + offset, count, MPI_BYTE, 0, comm);
+  }
+}
+
+Dataset *mpi_dataset_open(const char *path) {
+  int world_rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+  FILE *fin = NULL;
+  long long size = -1;
+  if (world_rank == 0) {
+    fin = fopen(path, "rb");
+    if (fin) {
+      fseeko(fin, 0, SEEK_END);
+      size = ftello(fin);
+      rewind(fin);
+    } else {
+      log_error("%s not found", path);
+    }
+  }
+  MPI_Bcast(&size, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+  if (size < 0) {
+    MPI_Finalize();
+    exit(EXIT_FAILURE);
+  }
+
+  // Ranks that can share memory make up a node, whose lowest rank holds the node's copy. Rank 0
+  // is the lowest rank of its node and of the node leaders.
+  MPI_Comm node, leaders;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, world_rank, MPI_INFO_NULL, &node);
+  int node_rank, node_size;
+  MPI_Comm_rank(node, &node_rank);
+  MPI_Comm_size(node, &node_size);
+  MPI_Comm_split(MPI_COMM_WORLD, node_rank == 0 ? 0 : MPI_UNDEFINED, world_rank, &leaders);
+
+  unsigned char *data;
+  MPI_Win_allocate_shared(node_rank == 0 ? (MPI_Aint)size : 0, 1, MPI_INFO_NULL, node, &data,
+                          &dataset_win);
+  if (node_rank != 0) {
+    MPI_Aint shared_size;
+    int disp_unit;
+    MPI_Win_shared_query(dataset_win, 0, &shared_size, &disp_unit, &data);
+  }
+
+  if (world_rank == 0) {
+    if (fread(data, 1, size, fin) != (size_t)size) {
+      log_error("Failed to read %s", path);
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    fclose(fin);
+  }
+  if (leaders != MPI_COMM_NULL) {
+    int num_nodes;
+    MPI_Comm_size(leaders, &num_nodes);
+    if (world_rank == 0) {
+      log_debug("Broadcasting %lld bytes of dataset to %d nodes, %d ranks on this one", size,
+                num_nodes, node_size);
+    }
+    bcast_bytes(data, size, leaders);
+    MPI_Comm_free(&leaders);
+  }
+  // Makes the leader's stores visible to the rest of the node
+  MPI_Win_fence(0, dataset_win);
+  MPI_Comm_free(&node);
+
+  return dataset_open_memory(path, data, size);
+}
+
+void mpi_dataset_close(Dataset *dataset) {
+  dataset_close(dataset);
+  MPI_Win_free(&dataset_win);
+}
+
+int mpi_image_read(const char *path, unsigned char **image, int *width, int *height, int *depth) {
+  int world_rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+  int dims[3] = {-1, 0, 0};
+  *image = NULL;
+  if (world_rank == 0) {
+    *image = image_read(path, &dims[0], &dims[1], &dims[2]);
+    if (*image == NULL) dims[0] = -1;
+  }
+  MPI_Bcast(dims, 3, MPI_INT, 0, MPI_COMM_WORLD);
+  if (dims[0] < 0) return -1;
+  *width = dims[0];
+  *height = dims[1];
+  *depth = dims[2];
+  return 0;
+}
+
+unsigned char *mpi_scatter_rows(unsigned char *image, int width, const int *rows) {
+  int world_rank, world_size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+  // Counted in tile rows so that gigapixel bands do not overflow an int count of bytes
+  MPI_Datatype tile_row;
+  MPI_Type_contiguous(width * H * C, MPI_BYTE, &tile_row);
+  MPI_Type_commit(&tile_row);
+  int *offsets = (int *)malloc(world_size * sizeof(int));
+  offsets[0] = 0;
+  for (int i = 1; i < world_size; ++i) offsets[i] = offsets[i - 1] + rows[i - 1];
+
+  unsigned char *band;
+  if (world_rank == 0) {
+    band = image;
+    MPI_Scatterv(image, rows, offsets, tile_row, MPI_IN_PLACE, 0, tile_row, 0, MPI_COMM_WORLD);
+  } else {
+    band = (unsigned char *)malloc((size_t)rows[world_rank] * width * H * C);
+    MPI_Scatterv(NULL, rows, offsets, tile_row, band, rows[world_rank], tile_row, 0,
+                 MPI_COMM_WORLD);
+  }
+  free(offsets);
+  MPI_Type_free(&tile_row);
+  return band;
+}
+
+unsigned char *mpi_bcast_image(unsigned char *image, int width, int height) {
+  int world_rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+  size_t size = (size_t)width * height * C;
+  if (world_rank != 0) image = (unsigned char *)malloc(size);
+  bcast_bytes(image, size, MPI_COMM_WORLD);
+  return image;
+}
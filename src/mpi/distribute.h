@@ -0,0 +1,36 @@
+#pragma once
+
+#include <dataset.h>
+
+/**
+ * Job-start input distribution for the MPI targets, so that the shared filesystem is read once
+ * per job instead of once per rank. Every function is collective over MPI_COMM_WORLD.
+ */
+
+/**
+ * Read the dataset file on rank 0 and broadcast it to one rank per node, which keeps it in an
+ * MPI-3 shared-memory window that the other ranks of its node use in place. Exits on failure.
+ * @param path read on rank 0 only
+ */
+Dataset *mpi_dataset_open(const char *path);
+void mpi_dataset_close(Dataset *dataset);
+
+/**
+ * Read the input image on rank 0 and broadcast its size; photomosaic_mpi() hands out the pixels
+ * @param image set to the pixels on rank 0, NULL on the other ranks
+ * @return 0, or -1 on every rank if rank 0 failed
+ */
+int mpi_image_read(const char *path, unsigned char **image, int *width, int *height, int *depth);
+
+/**
+ * Send every rank its band of whole tile rows of an image held by rank 0
+ * @param rows tile rows per rank, bands follow each other from the top of the image
+ * @return this rank's band; on rank 0 the top of image itself
+ */
+unsigned char *mpi_scatter_rows(unsigned char *image, int width, const int *rows);
+
+/**
+ * Send the whole image held by rank 0 to every rank
+ * @return image on rank 0, a new buffer elsewhere
+ */
+unsigned char *mpi_bcast_image(unsigned char *image, int width, int height);
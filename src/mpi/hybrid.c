@@ -0,0 +1,71 @@
+#define _POSIX_C_SOURCE 200809L
+#include <log/log.h>
+#include <mpi.h>
+#include <omp.h>
+#include <options.h>
+#include <photomosaic.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <util.h>
+#include "distribute.h"
+
+#define W 32
+#define H 32
+
+/**
+ * Threads for this rank: the cores it is bound to, or an even share of the node's cores among
+ * the ranks running on it
+ */
+static int rank_threads() {
+  // Collective, so every rank splits whether or not it needs the node size
+  MPI_Comm node;
+  int node_size;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+  MPI_Comm_size(node, &node_size);
+  MPI_Comm_free(&node);
+
+  int procs = omp_get_num_procs();
+  if (procs < sysconf(_SC_NPROCESSORS_ONLN)) return procs;
+  return procs / node_size > 0 ? procs / node_size : 1;
+}
+
+void photomosaic_mpi(unsigned char *image, int width, int height, const Dataset *dataset,
+                     int *indices, int world_rank, int world_size) {
+  if (world_rank == 0) {
+    log_info("=======================================");
+    log_info("Photomosaic MPI + OpenMP implementation");
+    log_info("=======================================");
+    log_info("MPI communication world size: %d", world_size);
+  } else {
+    log_set_level(LOG_WARN);  // The matcher logs as if it were alone, once is enough
+  }
+  if (options.threads == 0) options.threads = rank_threads();  // Same on every rank, from argv
+
+  // Each rank receives and matches only its band of whole tile rows
+  int seg_width = width / W;
+  int seg_height = height / H;
+  int *rows = (int *)malloc(world_size * sizeof(int));
+  int *offsets = (int *)malloc(world_size * sizeof(int));
+  int *tiles = (int *)malloc(world_size * sizeof(int));
+  for (int i = 0; i < world_size; ++i) {
+    int here = i * seg_height / world_size;
+    int next = (i + 1) * seg_height / world_size;
+    rows[i] = next - here;
+    offsets[i] = here * seg_width;
+    tiles[i] = rows[i] * seg_width;
+  }
+
+  if (world_rank == 0) timer_start();
+  unsigned char *band = mpi_scatter_rows(image, width, rows);
+  if (world_rank == 0) timer_stop_and_log("[photomosaic] scatter time");
+  if (rows[world_rank] > 0) photomosaic(band, width, rows[world_rank] * H, dataset, indices);
+
+  if (world_rank == 0) timer_start();
+  MPI_Gatherv(world_rank == 0 ? MPI_IN_PLACE : indices, tiles[world_rank], MPI_INT32_T, indices,
+              tiles, offsets, MPI_INT32_T, 0, MPI_COMM_WORLD);
+  if (world_rank == 0) timer_stop_and_log("[photomosaic] gather time");
+  if (band != image) free(band);
+  free(rows);
+  free(offsets);
+  free(tiles);
+}
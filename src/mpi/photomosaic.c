@@ -4,15 +4,15 @@
 #include <opencl/common.h>
 #include <photomosaic.h>
 #include <util.h>
+#include "distribute.h"
 
 #define W 32
 #define H 32
 #define C 3
 #define TILE_LEN (W * H * C)
-#define CIFAR10_SIZE 60000
-#define MIN_GPU_QUOTA 4
+#define MIN_GPU_QUOTA 4  // Fewest tiles per device before splitting the tiles is worth it
 
-void photomosaic_mpi(unsigned char *image, int width, int height, const unsigned char *dataset,
+void photomosaic_mpi(unsigned char *image, int width, int height, const Dataset *dataset,
                      int *indices, int world_rank, int world_size) {
   if (world_rank == 0) {
     log_info("=======================================");
@@ -21,37 +21,81 @@ void photomosaic_mpi(unsigned char *image, int width, int height, const unsigned
     log_info("MPI communication world size: %d", world_size);
   }
 
-  int num_tiles = (width / W) * (height / H);
-  if (num_tiles < MIN_GPU_QUOTA * NUM_GPUS) {
-    world_size = 1;
-    if (world_rank > 0)
-      return;
-    else
-      log_debug("Image is small; discard other nodes except rank 0");
-  }
-
   CLHost host = create_host(world_rank == 0);
-  preprocess_image(&host, image, width, height, world_rank == 0);
+
+  // Ranks may see different device counts; they must agree on how to split the work
+  int num_devs;
+  MPI_Allreduce(&host.num_devs, &num_devs, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+  int seg_width = width / W;
+  int seg_height = height / H;
+  int num_tiles = seg_width * seg_height;
 
   if (world_size == 1) {
+    preprocess_image(&host, image, width, height, true);
     photomosaic_opencl(&host, image, dataset, indices, num_tiles, true);
+    release_host(&host);
     return;
   }
 
+  if (num_tiles < MIN_GPU_QUOTA * num_devs * world_size) {
+    // Too few tiles to keep every device of every rank busy: each rank scans a slice of the
+    // dataset for all tiles and rank 0 keeps the closest image per tile
+    if (world_rank == 0) log_debug("Image is small; ranks split the dataset instead of the tiles");
+    unsigned char *whole = mpi_bcast_image(image, width, height);
+    preprocess_image(&host, whole, width, height, world_rank == 0);
+    int data_begin = (int)((long)world_rank * dataset->count / world_size);
+    int data_end = (int)((long)(world_rank + 1) * dataset->count / world_size);
+    int *matches = (int *)malloc(num_tiles * 2 * sizeof(int));  // (distance, index) pairs
+    int *dists = (int *)malloc(num_tiles * sizeof(int));
+    photomosaic_opencl_shard(&host, whole, dataset, data_begin, data_end, indices, dists,
+                             num_tiles, world_rank == 0);
+    for (int i = 0; i < num_tiles; ++i) {
+      matches[2 * i] = dists[i];
+      matches[2 * i + 1] = indices[i];
+    }
+
+    if (world_rank == 0) timer_start();
+    // MPI_MINLOC breaks ties towards the lower index, like a scan of the whole dataset
+    MPI_Reduce(world_rank == 0 ? MPI_IN_PLACE : matches, matches, num_tiles, MPI_2INT, MPI_MINLOC,
+               0, MPI_COMM_WORLD);
+    if (world_rank == 0) {
+      for (int i = 0; i < num_tiles; ++i) indices[i] = matches[2 * i + 1];
+      timer_stop_and_log("[photomosaic] reduce time");
+    }
+    if (whole != image) free(whole);
+    free(matches);
+    free(dists);
+    release_host(&host);
+    return;
+  }
+
+  // Each rank receives, preprocesses and matches only its band of whole tile rows
+  int *rows = (int *)malloc(world_size * sizeof(int));
   int *offsets = (int *)malloc(world_size * sizeof(int));
   int *tiles = (int *)malloc(world_size * sizeof(int));
   for (int i = 0; i < world_size; ++i) {
-    int here = i * num_tiles / world_size;
-    int next = (i + 1) * num_tiles / world_size;
-    offsets[i] = here;
-    tiles[i] = next - here;
+    int here = i * seg_height / world_size;
+    int next = (i + 1) * seg_height / world_size;
+    rows[i] = next - here;
+    offsets[i] = here * seg_width;
+    tiles[i] = rows[i] * seg_width;
   }
 
-  photomosaic_opencl(&host, image + offsets[world_rank] * TILE_LEN, dataset, indices,
-                     tiles[world_rank], world_rank);
+  if (world_rank == 0) timer_start();
+  unsigned char *band = mpi_scatter_rows(image, width, rows);
+  if (world_rank == 0) timer_stop_and_log("[photomosaic] scatter time");
+  if (rows[world_rank] > 0) {
+    preprocess_image(&host, band, width, rows[world_rank] * H, world_rank == 0);
+    photomosaic_opencl(&host, band, dataset, indices, tiles[world_rank], world_rank == 0);
+  }
 
   if (world_rank == 0) timer_start();
-  MPI_Gatherv(indices, tiles[world_rank], MPI_INT32_T, indices, tiles, offsets, MPI_INT32_T, 0,
-              MPI_COMM_WORLD);
+  MPI_Gatherv(world_rank == 0 ? MPI_IN_PLACE : indices, tiles[world_rank], MPI_INT32_T, indices,
+              tiles, offsets, MPI_INT32_T, 0, MPI_COMM_WORLD);
   if (world_rank == 0) timer_stop_and_log("[photomosaic] gather time");
+  if (band != image) free(band);
+  free(rows);
+  free(offsets);
+  free(tiles);
+  release_host(&host);
 }
@@ -1,15 +1,39 @@
+#define _POSIX_C_SOURCE 200809L
 #include "clwrapper.h"
+#include <limits.h>
 #include <log/log.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-cl_platform_id cl_get_platform_id() {
-  cl_platform_id platform;
-  CHECK_ERROR(clGetPlatformIDs(1, &platform, NULL));
-  return platform;
+#ifndef CL_PLATFORM_NOT_FOUND_KHR
+#define CL_PLATFORM_NOT_FOUND_KHR -1001  // From cl_ext.h: the ICD loader found no platform
+#endif
+
+cl_platform_id *cl_get_platform_ids(cl_uint *num_platforms) {
+  cl_int err = clGetPlatformIDs(0, NULL, num_platforms);
+  if (err == CL_PLATFORM_NOT_FOUND_KHR) {
+    *num_platforms = 0;
+  } else {
+    CHECK_ERROR(err);
+  }
+  cl_platform_id *platforms = malloc(sizeof(cl_platform_id) * (*num_platforms + 1));
+  if (*num_platforms > 0) CHECK_ERROR(clGetPlatformIDs(*num_platforms, platforms, NULL));
+  return platforms;
 }
 
-cl_device_id *cl_get_gpu_device_ids(cl_platform_id platform, cl_uint num_devices) {
-  cl_device_id *devices = malloc(sizeof(cl_device_id) * num_devices);
-  CHECK_ERROR(clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, num_devices, devices, NULL));
+cl_device_id *cl_get_device_ids(cl_platform_id platform, cl_device_type type,
+                                cl_uint *num_devices) {
+  cl_int err = clGetDeviceIDs(platform, type, 0, NULL, num_devices);
+  if (err == CL_DEVICE_NOT_FOUND) {
+    *num_devices = 0;
+  } else {
+    CHECK_ERROR(err);
+  }
+  cl_device_id *devices = malloc(sizeof(cl_device_id) * (*num_devices + 1));
+  if (*num_devices > 0) CHECK_ERROR(clGetDeviceIDs(platform, type, *num_devices, devices, NULL));
   return devices;
 }
 
@@ -50,37 +74,129 @@ cl_command_queue *cl_create_command_queues(cl_context ctx, cl_uint num_devices,
   return queues;
 }
 
-const char *get_source_code(const char *filename, size_t *len) {
-  char *source_code;
-  size_t length;
-  FILE *file = fopen(filename, "r");
-  if (file == NULL) {
-    printf("[%s:%d] Failed to open %s\n", __FILE__, __LINE__, filename);
-    exit(EXIT_FAILURE);
+#define CACHE_MAGIC 0x48434c50u  // "PLCH"
+#define BUILD_OPTIONS ""
+
+typedef struct {
+  uint32_t magic;
+  uint32_t key_size;      // Followed by the key, then the binary
+  uint64_t binary_size;
+} CacheHeader;
+
+/**
+ * 64-bit FNV-1a, enough to tell kernel sources apart in a cache file name
+ */
+static uint64_t fnv1a(const char *data, size_t size, uint64_t hash) {
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ull;
   }
+  return hash;
+}
 
-  fseek(file, 0, SEEK_END);
-  length = (size_t)ftell(file);
-  rewind(file);
+/**
+ * Cache directory: $PHOTOMOSAIC_CL_CACHE, else $XDG_CACHE_HOME/photomosaic, else
+ * ~/.cache/photomosaic. An empty $PHOTOMOSAIC_CL_CACHE disables the cache.
+ * @return 0 on success, -1 if there is no usable directory
+ */
+static int cache_dir(char *dir, size_t size) {
+  const char *env = getenv("PHOTOMOSAIC_CL_CACHE");
+  if (env != NULL) {
+    if (env[0] == '\0') return -1;
+    snprintf(dir, size, "%s", env);
+  } else if ((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] != '\0') {
+    snprintf(dir, size, "%s/photomosaic", env);
+  } else if ((env = getenv("HOME")) != NULL && env[0] != '\0') {
+    snprintf(dir, size, "%s/.cache", env);
+    mkdir(dir, 0755);
+    size_t len = strlen(dir);
+    snprintf(dir + len, size - len, "/photomosaic");
+  } else {
+    return -1;
+  }
+  mkdir(dir, 0755);
+  return 0;
+}
 
-  source_code = (char *)malloc(length + 1);
-  fread(source_code, length, 1, file);
-  source_code[length] = '\0';
+/**
+ * Everything a device binary depends on: the device, its driver, the build options and the
+ * source. The file name hashes it, the file itself stores it to rule out collisions.
+ */
+static void cache_entry(const char *name, const char *source, cl_device_id device, char *key,
+                        size_t key_size, char *path, size_t path_size) {
+  char device_name[256], device_version[256], driver_version[256];
+  CHECK_ERROR(clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL));
+  CHECK_ERROR(clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(device_version), device_version,
+                              NULL));
+  CHECK_ERROR(clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver_version), driver_version,
+                              NULL));
+  uint64_t source_hash = fnv1a(source, strlen(source), 0xcbf29ce484222325ull);
+  snprintf(key, key_size, "%s\n%s\n%s\n%s\n%016llx", device_name, device_version, driver_version,
+           BUILD_OPTIONS, (unsigned long long)source_hash);
+
+  char dir[PATH_MAX - 64];
+  path[0] = '\0';
+  if (cache_dir(dir, sizeof(dir)) != 0) return;
+  uint64_t key_hash = fnv1a(key, strlen(key), 0xcbf29ce484222325ull);
+  snprintf(path, path_size, "%s/%s-%016llx.bin", dir, name, (unsigned long long)key_hash);
+}
 
+/**
+ * @return the cached binary, or NULL if it is missing or was built for another key
+ */
+static unsigned char *cache_load(const char *path, const char *key, size_t *binary_size) {
+  FILE *file = path[0] ? fopen(path, "rb") : NULL;
+  if (file == NULL) return NULL;
+  CacheHeader header;
+  size_t key_size = strlen(key);
+  unsigned char *binary = NULL;
+  char *stored_key = NULL;
+  struct stat st;
+  // An entry is exactly header, key and binary; anything else is corrupt and a miss
+  if (fstat(fileno(file), &st) == 0 && fread(&header, sizeof(header), 1, file) == 1 &&
+      header.magic == CACHE_MAGIC && header.key_size == key_size && header.binary_size > 0 &&
+      header.binary_size == (uint64_t)st.st_size - sizeof(header) - key_size &&
+      (stored_key = (char *)malloc(key_size)) != NULL) {
+    if (fread(stored_key, 1, key_size, file) == key_size &&
+        memcmp(stored_key, key, key_size) == 0 &&
+        (binary = (unsigned char *)malloc(header.binary_size)) != NULL) {
+      if (fread(binary, 1, header.binary_size, file) != header.binary_size) {
+        free(binary);
+        binary = NULL;
+      }
+    }
+  }
+  free(stored_key);
   fclose(file);
+  *binary_size = binary ? header.binary_size : 0;
+  return binary;
+}
 
-  *len = length;
-  return source_code;
+/**
+ * Write through a temporary file and rename, so that concurrent runs never read a partial entry
+ */
+static void cache_store(const char *path, const char *key, const unsigned char *binary,
+                        size_t binary_size) {
+  if (path[0] == '\0' || binary_size == 0) return;
+  char tmp[PATH_MAX + 32];
+  snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+  FILE *file = fopen(tmp, "wb");
+  if (file == NULL) {
+    log_warn("Cannot write the program cache %s", tmp);
+    return;
+  }
+  CacheHeader header = {CACHE_MAGIC, (uint32_t)strlen(key), binary_size};
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(key, 1, header.key_size, file) == header.key_size &&
+           fwrite(binary, 1, binary_size, file) == binary_size;
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(tmp, path) != 0) {
+    log_warn("Cannot write the program cache %s", path);
+    remove(tmp);
+  }
 }
 
-cl_program cl_build_program(const char *source, cl_context ctx, unsigned num_devices,
-                            cl_device_id *devices) {
-  size_t source_size;
-  cl_int err;
-  const char *source_code = get_source_code(source, &source_size);
-  cl_program program = clCreateProgramWithSource(ctx, 1, &source_code, &source_size, &err);
-  CHECK_ERROR(err);
-  err = clBuildProgram(program, num_devices, devices, "", NULL, NULL);
+static cl_int build(cl_program program, unsigned num_devices, cl_device_id *devices) {
+  cl_int err = clBuildProgram(program, num_devices, devices, BUILD_OPTIONS, NULL, NULL);
   if (err == CL_BUILD_PROGRAM_FAILURE) {
     char *log;
     size_t log_size;
@@ -90,9 +206,85 @@ cl_program cl_build_program(const char *source, cl_context ctx, unsigned num_dev
     log[log_size] = '\0';
     fprintf(stderr, "Compile error:\n%s\n", log);
     free(log);
-    exit(EXIT_FAILURE);
   }
-  free((char *)source_code);
+  return err;
+}
+
+/**
+ * Load every device's binary from the cache
+ * @return the built program, or NULL if any device missed or the driver rejected a binary
+ */
+static cl_program load_cached_program(cl_context ctx, unsigned num_devices, cl_device_id *devices,
+                                      char (*keys)[1024], char (*paths)[PATH_MAX]) {
+  unsigned char **binaries = (unsigned char **)calloc(num_devices, sizeof(unsigned char *));
+  size_t *sizes = (size_t *)calloc(num_devices, sizeof(size_t));
+  unsigned loaded = 0;
+  while (loaded < num_devices &&
+         (binaries[loaded] = cache_load(paths[loaded], keys[loaded], &sizes[loaded])) != NULL) {
+    loaded++;
+  }
+
+  cl_program program = NULL;
+  if (loaded == num_devices) {
+    cl_int err;
+    cl_int *status = (cl_int *)malloc(num_devices * sizeof(cl_int));
+    program = clCreateProgramWithBinary(ctx, num_devices, devices, sizes,
+                                        (const unsigned char **)binaries, status, &err);
+    if (err == CL_SUCCESS) err = build(program, num_devices, devices);
+    if (err != CL_SUCCESS) {
+      log_warn("Cached program binary rejected (OpenCL error %d), rebuilding from source", err);
+      if (program) clReleaseProgram(program);
+      program = NULL;
+    }
+    free(status);
+  }
+  for (unsigned i = 0; i < num_devices; ++i) free(binaries[i]);
+  free(binaries);
+  free(sizes);
+  return program;
+}
+
+/**
+ * Save the binary of every device
+ */
+static void store_program(cl_program program, unsigned num_devices, char (*keys)[1024],
+                          char (*paths)[PATH_MAX]) {
+  size_t *sizes = (size_t *)malloc(num_devices * sizeof(size_t));
+  CHECK_ERROR(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, num_devices * sizeof(size_t),
+                               sizes, NULL));
+  unsigned char **binaries = (unsigned char **)malloc(num_devices * sizeof(unsigned char *));
+  for (unsigned i = 0; i < num_devices; ++i) binaries[i] = (unsigned char *)malloc(sizes[i]);
+  CHECK_ERROR(clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+                               num_devices * sizeof(unsigned char *), binaries, NULL));
+  for (unsigned i = 0; i < num_devices; ++i) {
+    cache_store(paths[i], keys[i], binaries[i], sizes[i]);
+    free(binaries[i]);
+  }
+  free(binaries);
+  free(sizes);
+}
+
+cl_program cl_build_program(const char *name, const char *source, cl_context ctx,
+                            unsigned num_devices, cl_device_id *devices) {
+  char(*keys)[1024] = malloc(num_devices * sizeof(*keys));
+  char(*paths)[PATH_MAX] = malloc(num_devices * sizeof(*paths));
+  for (unsigned i = 0; i < num_devices; ++i) {
+    cache_entry(name, source, devices[i], keys[i], sizeof(keys[i]), paths[i], sizeof(paths[i]));
+  }
+
+  cl_program program = load_cached_program(ctx, num_devices, devices, keys, paths);
+  if (program != NULL) {
+    log_debug("Program %s loaded from %s", name, paths[0]);
+  } else {
+    cl_int err;
+    size_t source_size = strlen(source);
+    program = clCreateProgramWithSource(ctx, 1, &source, &source_size, &err);
+    CHECK_ERROR(err);
+    if (build(program, num_devices, devices) != CL_SUCCESS) exit(EXIT_FAILURE);
+    store_program(program, num_devices, keys, paths);
+  }
+  free(keys);
+  free(paths);
   return program;
 }
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #ifdef __APPLE__
 #include <OpenCL/opencl.h>
@@ -14,14 +15,28 @@
     exit(1);                                                      \
   }
 
-cl_platform_id cl_get_platform_id();
-cl_device_id *cl_get_gpu_device_ids(cl_platform_id platform, cl_uint num_devices);
+/**
+ * Every platform, or none when the ICD loader finds no driver
+ */
+cl_platform_id *cl_get_platform_ids(cl_uint *num_platforms);
+/**
+ * Every device of the given type on a platform, possibly none
+ */
+cl_device_id *cl_get_device_ids(cl_platform_id platform, cl_device_type type,
+                                cl_uint *num_devices);
 cl_context cl_create_context(cl_uint num_devices, cl_device_id *devices);
 cl_command_queue cl_create_command_queue(cl_context ctx, cl_device_id device);
 cl_command_queue *cl_create_command_queues(cl_context ctx, cl_uint num_devices,
                                            cl_device_id *devices);
-cl_program cl_build_program(const char *source, cl_context ctx, unsigned num_devices,
-                            cl_device_id *devices);
+/**
+ * Build a program for the devices, reusing the binaries cached on disk by an earlier run with the
+ * same devices, driver and source. A missing or rejected entry falls back to compiling the
+ * source and rewrites the cache.
+ * @param name short program name, used in cache file names and logs
+ * @param source program source text
+ */
+cl_program cl_build_program(const char *name, const char *source, cl_context ctx,
+                            unsigned num_devices, cl_device_id *devices);
 cl_kernel cl_create_kernel(cl_program program, const char *kernel_name);
 cl_mem cl_create_buffer(cl_context ctx, cl_mem_flags flags, size_t size);
 cl_mem *cl_create_buffers(cl_context ctx, cl_mem_flags flags, size_t size, unsigned count);
@@ -1,63 +1,201 @@
+#define _POSIX_C_SOURCE 200809L
 #include "common.h"
 #include <log/log.h>
+#include <options.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <util.h>
+#include "photomosaic_cl.h"
+#include "tiling_cl.h"
 
 #define W 32
 #define H 32
 #define C 3
 #define TILE_LEN (W * H * C)
-#define CIFAR10_SIZE 60000
-#define MIN_GPU_QUOTA 4
+#define MIN_GPU_QUOTA 4    // Fewest tiles handed to a device at once
+#define SCHED_CHUNKS 4     // Chunks per device when the tiles are plenty
+#define KERNEL_TILES 4     // Image tiles per work-group of photomosaic_tiles, TILES in the kernel
+#define UPLOAD_CHUNK 4096  // Dataset images per transfer when the dataset first goes to a device
+#define MAX_DIST (TILE_LEN * 255 * 255)
+
+/**
+ * Whether a device matches one term of a -g selector
+ * @param index position of the device in the enumeration of every platform
+ */
+static bool device_matches(const char *term, int index, const CLDevice *dev,
+                           const char *platform) {
+  if (strcmp(term, "all") == 0) return true;
+  if (strcmp(term, "gpu") == 0) return dev->type & CL_DEVICE_TYPE_GPU;
+  if (strcmp(term, "cpu") == 0) return dev->type & CL_DEVICE_TYPE_CPU;
+  if (strcmp(term, "accelerator") == 0) return dev->type & CL_DEVICE_TYPE_ACCELERATOR;
+  char *end;
+  long k = strtol(term, &end, 10);
+  if (*term != '\0' && *end == '\0') return k == index;
+  return strstr(dev->name, term) != NULL || strstr(platform, term) != NULL;
+}
+
+static bool device_selected(const char *selector, int index, const CLDevice *dev,
+                            const char *platform) {
+  char *terms = strdup(selector);
+  bool selected = false;
+  for (char *term = strtok(terms, ","); term && !selected; term = strtok(NULL, ",")) {
+    selected = device_matches(term, index, dev, platform);
+  }
+  free(terms);
+  return selected;
+}
 
 CLHost create_host(bool print_stats) {
   CLHost host;
+  memset(&host, 0, sizeof(host));
   timer_start();
-  host.platform = cl_get_platform_id();
-  CHECK_ERROR(clGetDeviceIDs(host.platform, CL_DEVICE_TYPE_GPU, NUM_GPUS, host.devs, NULL));
-  if (print_stats) log_debug("OpenCL uses %d GPUs", NUM_GPUS);
-  host.ctx = cl_create_context(NUM_GPUS, host.devs);
-  for (int d = 0; d < NUM_GPUS; d++) {
-    host.read_queues[d] = cl_create_command_queue(host.ctx, host.devs[d]);
-    host.kernel_queues[d] = cl_create_command_queue(host.ctx, host.devs[d]);
-    host.write_queues[d] = cl_create_command_queue(host.ctx, host.devs[d]);
+
+  // Every device of every platform, in a fixed order so that -g indices are stable
+  cl_uint num_platforms;
+  cl_platform_id *platforms = cl_get_platform_ids(&num_platforms);
+  int num_found = 0;
+  CLDevice *found = NULL;
+  int *found_platform = NULL;
+  bool any_gpu = false;
+  for (cl_uint p = 0; p < num_platforms; ++p) {
+    cl_uint count;
+    cl_device_id *ids = cl_get_device_ids(platforms[p], CL_DEVICE_TYPE_ALL, &count);
+    found = (CLDevice *)realloc(found, (num_found + count) * sizeof(CLDevice));
+    found_platform = (int *)realloc(found_platform, (num_found + count) * sizeof(int));
+    for (cl_uint i = 0; i < count; ++i) {
+      CLDevice *dev = &found[num_found];
+      memset(dev, 0, sizeof(*dev));
+      dev->id = ids[i];
+      dev->index = num_found;
+      CHECK_ERROR(clGetDeviceInfo(ids[i], CL_DEVICE_TYPE, sizeof(dev->type), &dev->type, NULL));
+      CHECK_ERROR(clGetDeviceInfo(ids[i], CL_DEVICE_NAME, sizeof(dev->name), dev->name, NULL));
+      any_gpu = any_gpu || (dev->type & CL_DEVICE_TYPE_GPU);
+      found_platform[num_found++] = p;
+    }
+    free(ids);
+  }
+
+  // Without -g: the GPUs, or every device on machines without one
+  const char *selector = options.devices ? options.devices : any_gpu ? "gpu" : "all";
+  host.devs = (CLDevice *)malloc((num_found > 0 ? num_found : 1) * sizeof(CLDevice));
+  for (int i = 0; i < num_found; ++i) {
+    char platform[128];
+    CHECK_ERROR(clGetPlatformInfo(platforms[found_platform[i]], CL_PLATFORM_NAME,
+                                  sizeof(platform), platform, NULL));
+    bool selected = device_selected(selector, i, &found[i], platform);
+    if (print_stats) {
+      log_debug("OpenCL device %d: %s (%s, %s)%s", i, found[i].name,
+                found[i].type & CL_DEVICE_TYPE_GPU   ? "GPU"
+                : found[i].type & CL_DEVICE_TYPE_CPU ? "CPU"
+                                                     : "other",
+                platform, selected ? "" : ", not selected");
+    }
+    if (selected) host.devs[host.num_devs++] = found[i];
+  }
+  free(found);
+  free(found_platform);
+  free(platforms);
+  if (host.num_devs == 0) {
+    log_error("No OpenCL device matches \"%s\"", selector);
+    exit(EXIT_FAILURE);
   }
+
+  for (int d = 0; d < host.num_devs; d++) {
+    CLDevice *dev = &host.devs[d];
+    dev->ctx = cl_create_context(1, &dev->id);
+    dev->read_queue = cl_create_command_queue(dev->ctx, dev->id);
+    dev->kernel_queue = cl_create_command_queue(dev->ctx, dev->id);
+    dev->write_queue = cl_create_command_queue(dev->ctx, dev->id);
+  }
+  if (print_stats) log_debug("OpenCL uses %d devices", host.num_devs);
   if (print_stats) timer_stop_and_log("[init] init time");
   return host;
 }
 
+/**
+ * Drop the device copies of the dataset, e.g. before uploading another one
+ */
+static void release_uploads(CLDevice *device) {
+  if (device->uploads == NULL) return;
+  clWaitForEvents(device->num_uploads, device->uploads);
+  for (int b = 0; b < device->num_uploads; ++b) clReleaseEvent(device->uploads[b]);
+  free(device->uploads);
+  device->uploads = NULL;
+  device->num_uploads = 0;
+}
+
+static void release_dataset_buffers(CLHost *host) {
+  for (int d = 0; d < host->num_devs; d++) {
+    release_uploads(&host->devs[d]);
+    if (host->devs[d].dataset_buffer) cl_release_mem_object(host->devs[d].dataset_buffer);
+    host->devs[d].dataset_buffer = NULL;
+  }
+  host->dataset = NULL;
+}
+
+void release_host(CLHost *host) {
+  release_dataset_buffers(host);
+  for (int d = 0; d < host->num_devs; d++) {
+    CLDevice *dev = &host->devs[d];
+    if (dev->tiling_program) cl_release_program(dev->tiling_program);
+    if (dev->photomosaic_program) cl_release_program(dev->photomosaic_program);
+    cl_release_command_queues(&dev->read_queue, 1);
+    cl_release_command_queues(&dev->kernel_queue, 1);
+    cl_release_command_queues(&dev->write_queue, 1);
+    cl_release_context(dev->ctx);
+  }
+  free(host->devs);
+}
+
+/**
+ * Build a program on every device that does not have it yet
+ * @param program offset of the program field in CLDevice
+ */
+static void build_programs(CLHost *host, size_t program, const char *name, const char *source,
+                           bool print_stats) {
+  for (int d = 0; d < host->num_devs; d++) {
+    CLDevice *dev = &host->devs[d];
+    cl_program *built = (cl_program *)((char *)dev + program);
+    if (*built) continue;
+    if (print_stats) timer_start();
+    *built = cl_build_program(name, source, dev->ctx, 1, &dev->id);
+    if (print_stats) {
+      char label[192];
+      snprintf(label, sizeof(label), "[%s] compile time on %s", name, dev->name);
+      timer_stop_and_log(label);
+    }
+  }
+}
+
 void preprocess_image(CLHost *host, unsigned char *image, int width, int height, bool print_stats) {
 #define NUM_BUFS 2
 
-  if (print_stats) timer_start();
-  cl_program program = cl_build_program("src/opencl/tiling.cl", host->ctx, NUM_GPUS, host->devs);
-  cl_kernel kernel = cl_create_kernel(program, "nchw_tiling");
-  if (print_stats) timer_stop_and_log("[preprocess] compile time");
+  int num_devs = host->num_devs;
+  build_programs(host, offsetof(CLDevice, tiling_program), "tiling", tiling_cl, print_stats);
+  cl_kernel *kernels = (cl_kernel *)malloc(num_devs * sizeof(cl_kernel));
+  for (int d = 0; d < num_devs; ++d) {
+    kernels[d] = cl_create_kernel(host->devs[d].tiling_program, "nchw_tiling");
+  }
 
   if (print_stats) timer_start();
   int row_size = width * H * C * sizeof(unsigned char);
-  cl_mem buf_src[NUM_GPUS][NUM_BUFS];
-  cl_mem buf_dest[NUM_GPUS][NUM_BUFS];
-  for (int d = 0; d < NUM_GPUS; ++d) {
+  cl_mem(*buf_src)[NUM_BUFS] = malloc(num_devs * sizeof(*buf_src));
+  cl_mem(*buf_dest)[NUM_BUFS] = malloc(num_devs * sizeof(*buf_dest));
+  for (int d = 0; d < num_devs; ++d) {
     for (int k = 0; k < NUM_BUFS; ++k) {
-      buf_src[d][k] = cl_create_buffer(host->ctx, CL_MEM_READ_ONLY, row_size);
-      buf_dest[d][k] = cl_create_buffer(host->ctx, CL_MEM_WRITE_ONLY, row_size);
+      buf_src[d][k] = cl_create_buffer(host->devs[d].ctx, CL_MEM_READ_ONLY, row_size);
+      buf_dest[d][k] = cl_create_buffer(host->devs[d].ctx, CL_MEM_WRITE_ONLY, row_size);
     }
   }
   if (print_stats) timer_stop_and_log("[preprocess] buffer allocation time");
 
   if (print_stats) timer_start();
   int num_rows = height / H;
-  int partitions[NUM_GPUS + 1];
-  for (int d = 0; d <= NUM_GPUS; ++d) {
-    partitions[d] = (num_rows * d) / NUM_GPUS;
-  }
-
-  for (int d = 0; d < NUM_GPUS; ++d) {
-    for (int k = 0; k < NUM_BUFS; ++k) {
-      clSetKernelArg(kernel, 0, sizeof(cl_mem), &buf_src[d][k]);
-      clSetKernelArg(kernel, 1, sizeof(cl_mem), &buf_dest[d][k]);
-      clSetKernelArg(kernel, 2, sizeof(int), &width);
-    }
+  int *partitions = (int *)malloc((num_devs + 1) * sizeof(int));
+  for (int d = 0; d <= num_devs; ++d) {
+    partitions[d] = (num_rows * d) / num_devs;
   }
 
   size_t global_size = 256 * (width / 32);
@@ -65,115 +203,463 @@ void preprocess_image(CLHost *host, unsigned char *image, int width, int height,
   cl_event write_events[NUM_BUFS];
   cl_event kernel_events[NUM_BUFS];
   cl_event read_events[NUM_BUFS];
-  for (int d = 0; d < NUM_GPUS; ++d) {
+  for (int d = 0; d < num_devs; ++d) {
+    CLDevice *dev = &host->devs[d];
+    cl_kernel kernel = kernels[d];
     for (int row = partitions[d]; row < partitions[d + 1]; ++row) {
       unsigned char *image_pos = image + row_size * row;
       int i = row - partitions[d];
       int k = i % NUM_BUFS;
       if (i < NUM_BUFS) {
-        clEnqueueWriteBuffer(host->write_queues[d], buf_src[d][k], CL_FALSE, 0, row_size, image_pos,
-                             0, NULL, &write_events[k]);
+        clEnqueueWriteBuffer(dev->write_queue, buf_src[d][k], CL_FALSE, 0, row_size, image_pos, 0,
+                             NULL, &write_events[k]);
         clSetKernelArg(kernel, 0, sizeof(cl_mem), &buf_src[d][k]);
         clSetKernelArg(kernel, 1, sizeof(cl_mem), &buf_dest[d][k]);
         clSetKernelArg(kernel, 2, sizeof(int), &width);
-        clEnqueueNDRangeKernel(host->kernel_queues[d], kernel, 1, NULL, &global_size, &local_size,
-                               1, &write_events[k], &kernel_events[k]);
-        clEnqueueReadBuffer(host->read_queues[d], buf_dest[d][k], CL_FALSE, 0, row_size, image_pos,
-                            1, &kernel_events[k], &read_events[k]);
+        clEnqueueNDRangeKernel(dev->kernel_queue, kernel, 1, NULL, &global_size, &local_size, 1,
+                               &write_events[k], &kernel_events[k]);
+        clEnqueueReadBuffer(dev->read_queue, buf_dest[d][k], CL_FALSE, 0, row_size, image_pos, 1,
+                            &kernel_events[k], &read_events[k]);
       } else {
-        clEnqueueWriteBuffer(host->write_queues[d], buf_src[d][k], CL_FALSE, 0, row_size, image_pos,
-                             1, &kernel_events[k], &write_events[k]);
+        clEnqueueWriteBuffer(dev->write_queue, buf_src[d][k], CL_FALSE, 0, row_size, image_pos, 1,
+                             &kernel_events[k], &write_events[k]);
         clSetKernelArg(kernel, 0, sizeof(cl_mem), &buf_src[d][k]);
         clSetKernelArg(kernel, 1, sizeof(cl_mem), &buf_dest[d][k]);
         clSetKernelArg(kernel, 2, sizeof(int), &width);
         cl_event kernel_wait_list[2] = {write_events[k], read_events[k]};
-        clEnqueueNDRangeKernel(host->kernel_queues[d], kernel, 1, NULL, &global_size, &local_size,
-                               2, kernel_wait_list, &kernel_events[k]);
-        clEnqueueReadBuffer(host->read_queues[d], buf_dest[d][k], CL_FALSE, 0, row_size, image_pos,
-                            1, &kernel_events[k], &read_events[k]);
+        clEnqueueNDRangeKernel(dev->kernel_queue, kernel, 1, NULL, &global_size, &local_size, 2,
+                               kernel_wait_list, &kernel_events[k]);
+        clEnqueueReadBuffer(dev->read_queue, buf_dest[d][k], CL_FALSE, 0, row_size, image_pos, 1,
+                            &kernel_events[k], &read_events[k]);
       }
     }
   }
 
-  cl_all_finish(host->read_queues, NUM_GPUS);
-  cl_release_program(program);
-  for (int d = 0; d < NUM_GPUS; ++d) {
+  for (int d = 0; d < num_devs; ++d) {
+    CHECK_ERROR(clFinish(host->devs[d].read_queue));
     for (int k = 0; k < NUM_BUFS; ++k) {
       cl_release_mem_object(buf_src[d][k]);
       cl_release_mem_object(buf_dest[d][k]);
     }
+    cl_release_kernel(kernels[d]);
   }
-  cl_release_kernel(kernel);
+  free(buf_src);
+  free(buf_dest);
+  free(partitions);
+  free(kernels);
 
   if (print_stats) timer_stop_and_log("[preprocess] preprocessing time");
 }
 
-void photomosaic_opencl(CLHost *host, unsigned char *image, const unsigned char *dataset,
-                        int *indices, int num_tiles, bool print_stats) {
-  int num_gpus = NUM_GPUS;
-  if (num_tiles < MIN_GPU_QUOTA * NUM_GPUS)
-    num_gpus = (num_tiles + MIN_GPU_QUOTA - 1) / MIN_GPU_QUOTA;
+typedef enum {
+  MATCH_FULL,     // photomosaic: one launch over the whole dataset
+  MATCH_BLOCKED,  // photomosaic_block: one launch per dataset block
+  MATCH_TILED,    // photomosaic_tiles: several tiles per work-group, one launch per block
+  MATCH_PYRAMID,  // photomosaic_pyramid: thumbnail bounds, then the full distance
+} Strategy;
 
-  if (print_stats) timer_start();
-  cl_program program =
-      cl_build_program("src/opencl/photomosaic.cl", host->ctx, num_gpus, host->devs);
-  cl_kernel kernel = cl_create_kernel(program, "photomosaic");
-  if (print_stats) timer_stop_and_log("[photomosaic] compile time");
+/**
+ * Tiles of one photomosaic_opencl() call, handed out in chunks to whichever device asks first,
+ * so that a faster or less busy device ends up matching more of them. Too few tiles to go
+ * around are not split at all: each device then scans its own shard of the dataset for every
+ * tile and the host keeps the closest of the devices' winners.
+ */
+typedef struct {
+  CLHost *host;
+  Strategy strategy;
+  const Dataset *dataset;
+  const unsigned char *image;  // Preprocessed tiles
+  int *indices;
+  int num_tiles;
+  int chunk;       // Tiles per request
+  int block;       // Dataset images per launch of the blocked kernels and per upload transfer
+  int num_blocks;
+  bool sharded;    // Devices split the dataset instead of the tiles
+
+  pthread_mutex_t lock;
+  int next;         // First tile not handed out yet
+  int num_changed;  // Pyramid: tiles where the full SSD overturned the thumbnail winner
+} Schedule;
+
+/**
+ * Host thread driving one device
+ */
+typedef struct {
+  Schedule *schedule;
+  int dev;
+  int num_tiles;  // Tiles this device matched
+  double busy;    // Seconds from its first chunk to its last result
+
+  int data_begin;  // Dataset images this device scans, all of them unless sharded
+  int data_end;
+  int *indices;  // Sharded: winner of every tile within the shard, and its distance
+  int *dists;
+} DeviceWorker;
+
+/**
+ * Claim the next chunk of tiles
+ * @return false once every tile has been handed out
+ */
+static bool take_chunk(Schedule *s, int *first, int *count) {
+  pthread_mutex_lock(&s->lock);
+  *first = s->next;
+  *count = s->num_tiles - s->next < s->chunk ? s->num_tiles - s->next : s->chunk;
+  s->next += *count;
+  pthread_mutex_unlock(&s->lock);
+  return *count > 0;
+}
+
+/**
+ * Sharded schedules hand every tile to every device with a non-empty shard, once
+ */
+static bool take_shard(DeviceWorker *worker, int *first, int *count) {
+  bool taken = worker->num_tiles > 0 || worker->data_begin == worker->data_end;
+  *first = 0;
+  *count = taken ? 0 : worker->schedule->num_tiles;
+  return *count > 0;
+}
+
+/**
+ * Give a device its copy of the dataset. A copy already on the device is reused; a new one is
+ * enqueued in blocks on the device's write queue without blocking the host, so that matching
+ * can start on the first block while the later ones are in flight. The blocks go from the one
+ * holding first_image to the end, then wrap around, so that a device scanning a shard gets its
+ * own images first.
+ * @return the transfer event of each block, in dataset order, or NULL once the whole copy is
+ *         known to be on the device
+ */
+static cl_event *upload_dataset(CLDevice *device, const Dataset *dataset, int block,
+                                int num_blocks, int first_image) {
+  if (device->dataset_buffer != NULL) return device->uploads;
+  size_t dataset_size = (size_t)dataset->count * TILE_LEN;
+  device->dataset_buffer = cl_create_buffer(device->ctx, CL_MEM_READ_ONLY, dataset_size);
+  cl_event *uploaded = (cl_event *)malloc(num_blocks * sizeof(cl_event));
+  for (int k = 0; k < num_blocks; ++k) {
+    int b = (first_image / block + k) % num_blocks;
+    size_t offset = (size_t)b * block * TILE_LEN;
+    size_t size = offset + (size_t)block * TILE_LEN < dataset_size ? (size_t)block * TILE_LEN
+                                                                    : dataset_size - offset;
+    clEnqueueWriteBuffer(device->write_queue, device->dataset_buffer, CL_FALSE, offset, size,
+                         dataset->tiles + offset, 0, NULL, &uploaded[b]);
+  }
+  clFlush(device->write_queue);
+  device->uploads = uploaded;
+  device->num_uploads = num_blocks;
+  return uploaded;
+}
 
-  cl_mem *buf_dataset = (cl_mem *)malloc(num_gpus * sizeof(cl_mem));
-  for (int dev = 0; dev < num_gpus; ++dev) {
-    buf_dataset[dev] = cl_create_buffer(host->ctx, CL_MEM_READ_ONLY, CIFAR10_SIZE * TILE_LEN);
+/**
+ * Dataset-block-outer strategy: the device walks images [data_begin, data_end) of the dataset
+ * block images at a time and launches one kernel per block over all tiles of the chunk, so the
+ * block is shared in device cache by every work-group. The running minimum of each tile lives in
+ * device buffers between launches.
+ * @param kernel photomosaic_block (one tile per work-group) or photomosaic_tiles
+ *               (tiles_per_group tiles per work-group)
+ * @param uploaded if not NULL, the transfer event of each block; each launch waits only for its
+ *                 own block
+ */
+static void match_blocked(CLDevice *device, cl_kernel kernel, int tiles_per_group, cl_mem buf_image,
+                          int num_images, int data_begin, int data_end, int block,
+                          const cl_event *uploaded, cl_mem buf_indices, cl_mem buf_min_dists) {
+  int *init_dists = (int *)malloc(num_images * sizeof(int));
+  int *init_indices = (int *)calloc(num_images, sizeof(int));
+  for (int i = 0; i < num_images; ++i) {
+    init_dists[i] = MAX_DIST;
   }
+  clEnqueueWriteBuffer(device->kernel_queue, buf_min_dists, CL_TRUE, 0, num_images * sizeof(int),
+                       init_dists, 0, NULL, NULL);
+  clEnqueueWriteBuffer(device->kernel_queue, buf_indices, CL_TRUE, 0, num_images * sizeof(int),
+                       init_indices, 0, NULL, NULL);
+
+  cl_mem buf_dataset = device->dataset_buffer;
+  for (int begin = data_begin, end; begin < data_end; begin = end) {
+    // Launches stop at block boundaries, which are also the upload boundaries
+    end = (begin / block + 1) * block < data_end ? (begin / block + 1) * block : data_end;
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), &buf_image);
+    clSetKernelArg(kernel, 1, sizeof(cl_mem), &buf_dataset);
+    clSetKernelArg(kernel, 2, sizeof(cl_mem), &buf_indices);
+    clSetKernelArg(kernel, 3, sizeof(cl_mem), &buf_min_dists);
+    clSetKernelArg(kernel, 4, sizeof(int), &num_images);
+    clSetKernelArg(kernel, 5, sizeof(int), &begin);
+    clSetKernelArg(kernel, 6, sizeof(int), &end);
 
-  cl_mem *buf_image = (cl_mem *)malloc(num_gpus * sizeof(cl_mem));
-  int *partitions = (int *)malloc((num_gpus + 1) * sizeof(int));
-  for (int dev = 0; dev <= num_gpus; ++dev) {
-    partitions[dev] = (num_tiles * dev) / num_gpus;
+    size_t global_size = (size_t)(num_images + tiles_per_group - 1) / tiles_per_group * 256;
+    size_t local_size = 256;
+    clEnqueueNDRangeKernel(device->kernel_queue, kernel, 1, NULL, &global_size, &local_size,
+                           uploaded ? 1 : 0, uploaded ? &uploaded[begin / block] : NULL, NULL);
   }
-  for (int dev = 0; dev < num_gpus; ++dev) {
-    int tiles = partitions[dev + 1] - partitions[dev];
-    buf_image[dev] = cl_create_buffer(host->ctx, CL_MEM_READ_ONLY, tiles * TILE_LEN);
+  CHECK_ERROR(clFinish(device->kernel_queue));
+  free(init_dists);
+  free(init_indices);
+}
+
+/**
+ * Coarse-to-fine strategy: the photomosaic_pyramid kernel only runs the full distance where the
+ * thumbnail bound allows it. Every tile needs the whole dataset, so a device still receiving it
+ * waits for all of its blocks.
+ */
+static void match_pyramid(CLDevice *device, cl_kernel kernel, cl_mem buf_image, int num_images,
+                          int num_data, cl_mem buf_thumbs, const cl_event *uploaded,
+                          int num_blocks, cl_mem buf_indices, cl_mem buf_coarse) {
+  cl_mem buf_dataset = device->dataset_buffer;
+  clSetKernelArg(kernel, 0, sizeof(cl_mem), &buf_image);
+  clSetKernelArg(kernel, 1, sizeof(cl_mem), &buf_dataset);
+  clSetKernelArg(kernel, 2, sizeof(cl_mem), &buf_thumbs);
+  clSetKernelArg(kernel, 3, sizeof(cl_mem), &buf_indices);
+  clSetKernelArg(kernel, 4, sizeof(cl_mem), &buf_coarse);
+  clSetKernelArg(kernel, 5, sizeof(int), &num_images);
+  clSetKernelArg(kernel, 6, sizeof(int), &num_data);
+
+  size_t global_size = num_images * 256;
+  size_t local_size = 256;
+  clEnqueueNDRangeKernel(device->kernel_queue, kernel, 1, NULL, &global_size, &local_size,
+                         uploaded ? num_blocks : 0, uploaded, NULL);
+  CHECK_ERROR(clFinish(device->kernel_queue));
+}
+
+static void match_full(CLDevice *device, cl_kernel kernel, cl_mem buf_image, int num_images,
+                       int num_data, cl_mem buf_indices) {
+  cl_mem buf_dataset = device->dataset_buffer;
+  clSetKernelArg(kernel, 0, sizeof(cl_mem), &buf_image);
+  clSetKernelArg(kernel, 1, sizeof(cl_mem), &buf_dataset);
+  clSetKernelArg(kernel, 2, sizeof(cl_mem), &buf_indices);
+  clSetKernelArg(kernel, 3, sizeof(int), &num_images);
+  clSetKernelArg(kernel, 4, sizeof(int), &num_data);
+
+  size_t global_size = num_images * 256;
+  size_t local_size = 256;
+  clEnqueueNDRangeKernel(device->kernel_queue, kernel, 1, NULL, &global_size, &local_size, 0, NULL,
+                         NULL);
+  CHECK_ERROR(clFinish(device->kernel_queue));
+}
+
+/**
+ * Match chunks on one device until the schedule runs dry. The device is set up, and its
+ * dataset copy uploaded if needed, when it claims its first chunk. Kernels get their arguments
+ * set per chunk, so every worker creates its own.
+ */
+static void *device_worker(void *arg) {
+  DeviceWorker *worker = (DeviceWorker *)arg;
+  Schedule *s = worker->schedule;
+  CLDevice *device = &s->host->devs[worker->dev];
+  int num_data = s->dataset->count;
+
+  cl_event *uploaded = NULL;
+  cl_kernel kernel = NULL, block_kernel = NULL;
+  cl_mem buf_image = NULL, buf_indices = NULL, buf_min_dists = NULL;
+  cl_mem buf_thumbs = NULL, buf_coarse = NULL;
+  int *coarse = NULL;
+  double start = 0;
+  int first, count;
+  while (s->sharded ? take_shard(worker, &first, &count) : take_chunk(s, &first, &count)) {
+    if (kernel == NULL) {
+      start = timer_now();
+      uploaded = upload_dataset(device, s->dataset, s->block, s->num_blocks, worker->data_begin);
+      const char *names[] = {"photomosaic", "photomosaic_block", "photomosaic_tiles",
+                             "photomosaic_pyramid"};
+      kernel = cl_create_kernel(device->photomosaic_program, names[s->strategy]);
+      block_kernel = cl_create_kernel(device->photomosaic_program, "photomosaic_block");
+      buf_image = cl_create_buffer(device->ctx, CL_MEM_READ_ONLY, (size_t)s->chunk * TILE_LEN);
+      buf_indices = cl_create_buffer(device->ctx, CL_MEM_READ_WRITE, s->chunk * sizeof(int));
+      buf_min_dists = cl_create_buffer(device->ctx, CL_MEM_READ_WRITE, s->chunk * sizeof(int));
+      if (s->strategy == MATCH_PYRAMID) {
+        size_t thumbs_size = (size_t)num_data * THUMB_LEN * sizeof(unsigned short);
+        buf_thumbs = cl_create_buffer(device->ctx, CL_MEM_READ_ONLY, thumbs_size);
+        buf_coarse = cl_create_buffer(device->ctx, CL_MEM_WRITE_ONLY, s->chunk * sizeof(int));
+        clEnqueueWriteBuffer(device->kernel_queue, buf_thumbs, CL_FALSE, 0, thumbs_size,
+                             s->dataset->thumbs, 0, NULL, NULL);
+        coarse = (int *)malloc(s->chunk * sizeof(int));
+      }
+    }
+
+    // On the kernel queue: the write queue may still be busy with the dataset
+    clEnqueueWriteBuffer(device->kernel_queue, buf_image, CL_FALSE, 0, count * TILE_LEN,
+                         s->image + (size_t)first * TILE_LEN, 0, NULL, NULL);
+    // While its dataset copy is still arriving, a device matches block by block so that it
+    // only waits for the blocks it has reached
+    bool arriving = uploaded != NULL;
+    switch (s->strategy) {
+      case MATCH_PYRAMID:
+        match_pyramid(device, kernel, buf_image, count, num_data, buf_thumbs, uploaded,
+                      s->num_blocks, buf_indices, buf_coarse);
+        break;
+      case MATCH_TILED:
+        match_blocked(device, kernel, KERNEL_TILES, buf_image, count, worker->data_begin,
+                      worker->data_end,
+                      arriving || options.opencl_block > 0 ? s->block : num_data, uploaded,
+                      buf_indices, buf_min_dists);
+        break;
+      case MATCH_BLOCKED:
+        match_blocked(device, kernel, 1, buf_image, count, worker->data_begin, worker->data_end,
+                      s->block, uploaded, buf_indices, buf_min_dists);
+        break;
+      case MATCH_FULL:
+        if (arriving || s->sharded) {
+          match_blocked(device, block_kernel, 1, buf_image, count, worker->data_begin,
+                        worker->data_end, arriving ? s->block : num_data, uploaded, buf_indices,
+                        buf_min_dists);
+        } else {
+          match_full(device, kernel, buf_image, count, num_data, buf_indices);
+        }
+        break;
+    }
+    if (uploaded && !s->sharded) {
+      // The first chunk waited for every block, later chunks and calls need no events
+      release_uploads(device);
+    }
+    // A shard only waited for its own blocks, the others may still be copying: the device
+    // keeps the events so that later calls wait for the blocks they reach
+    uploaded = NULL;
+    clEnqueueReadBuffer(device->read_queue, buf_indices, CL_TRUE, 0, count * sizeof(int),
+                        s->sharded ? worker->indices : s->indices + first, 0, NULL, NULL);
+    if (s->sharded) {
+      clEnqueueReadBuffer(device->read_queue, buf_min_dists, CL_TRUE, 0, count * sizeof(int),
+                          worker->dists, 0, NULL, NULL);
+    }
+    if (coarse) {
+      clEnqueueReadBuffer(device->read_queue, buf_coarse, CL_TRUE, 0, count * sizeof(int),
+                          coarse, 0, NULL, NULL);
+      int num_changed = 0;
+      for (int i = 0; i < count; ++i) {
+        if (coarse[i] != s->indices[first + i]) num_changed++;
+      }
+      pthread_mutex_lock(&s->lock);
+      s->num_changed += num_changed;
+      pthread_mutex_unlock(&s->lock);
+    }
+    worker->num_tiles += count;
   }
+  if (kernel == NULL) return NULL;  // Every chunk went to other devices
+
+  worker->busy = timer_now() - start;
+  cl_release_mem_object(buf_image);
+  cl_release_mem_object(buf_indices);
+  cl_release_mem_object(buf_min_dists);
+  if (buf_thumbs) cl_release_mem_object(buf_thumbs);
+  if (buf_coarse) cl_release_mem_object(buf_coarse);
+  cl_release_kernel(kernel);
+  cl_release_kernel(block_kernel);
+  free(coarse);
+  return NULL;
+}
+
+/**
+ * Match tiles on every device at once, either chunks of tiles over the whole dataset or, when
+ * sharded, every tile over an even share of images [data_begin, data_end) per device
+ */
+static void run_schedule(CLHost *host, unsigned char *image, const Dataset *dataset,
+                         int data_begin, int data_end, int *indices, int *dists, int num_tiles,
+                         bool sharded, bool print_stats) {
+  build_programs(host, offsetof(CLDevice, photomosaic_program), "photomosaic", photomosaic_cl,
+                 print_stats);
+
+  // The dataset stays on the devices between calls
+  if (host->dataset != dataset) release_dataset_buffers(host);
+  host->dataset = dataset;
 
-  cl_mem buf_indices[num_gpus];
-  for (int dev = 0; dev < num_gpus; ++dev) {
-    int tiles = partitions[dev + 1] - partitions[dev];
-    buf_indices[dev] = cl_create_buffer(host->ctx, CL_MEM_WRITE_ONLY, tiles * sizeof(int));
+  Schedule s;
+  memset(&s, 0, sizeof(s));
+  s.host = host;
+  s.dataset = dataset;
+  s.image = image;
+  s.indices = indices;
+  s.num_tiles = num_tiles;
+  s.sharded = sharded;
+  if (strcmp(options.search, "pyramid") == 0 && !sharded) {
+    s.strategy = MATCH_PYRAMID;  // Its bounds need the whole dataset, shards use linear scans
+  } else if (strcmp(options.search, "tiled") == 0) {
+    s.strategy = MATCH_TILED;
+  } else {
+    s.strategy = options.opencl_block > 0 ? MATCH_BLOCKED : MATCH_FULL;
   }
+  // About SCHED_CHUNKS chunks per device so that the load evens out, but never so few tiles that
+  // a launch cannot fill a device; whole work-groups of photomosaic_tiles
+  s.chunk = sharded ? num_tiles : num_tiles / (host->num_devs * SCHED_CHUNKS);
+  if (s.chunk < MIN_GPU_QUOTA) s.chunk = MIN_GPU_QUOTA;
+  s.chunk = (s.chunk + KERNEL_TILES - 1) / KERNEL_TILES * KERNEL_TILES;
+  s.block = options.opencl_block > 0 ? options.opencl_block : UPLOAD_CHUNK;
+  s.num_blocks = (dataset->count + s.block - 1) / s.block;
+  pthread_mutex_init(&s.lock, NULL);
 
   if (print_stats) timer_start();
-  for (int dev = 0; dev < num_gpus; ++dev) {
-    int tiles = partitions[dev + 1] - partitions[dev];
-    clEnqueueWriteBuffer(host->write_queues[dev], buf_image[dev], CL_TRUE, 0, tiles * TILE_LEN,
-                         image + (partitions[dev] * TILE_LEN), 0, NULL, NULL);
-    clEnqueueWriteBuffer(host->write_queues[dev], buf_dataset[dev], CL_TRUE, 0,
-                         CIFAR10_SIZE * TILE_LEN, dataset, 0, NULL, NULL);
+  DeviceWorker *workers = (DeviceWorker *)calloc(host->num_devs, sizeof(DeviceWorker));
+  pthread_t *threads = (pthread_t *)malloc(host->num_devs * sizeof(pthread_t));
+  for (int dev = 0; dev < host->num_devs; ++dev) {
+    DeviceWorker *w = &workers[dev];
+    w->schedule = &s;
+    w->dev = dev;
+    w->data_begin = data_begin;
+    w->data_end = data_end;
+    if (sharded) {
+      int num_data = data_end - data_begin;
+      w->data_begin = data_begin + (int)((long)dev * num_data / host->num_devs);
+      w->data_end = data_begin + (int)((long)(dev + 1) * num_data / host->num_devs);
+      w->indices = (int *)malloc(num_tiles * sizeof(int));
+      w->dists = (int *)malloc(num_tiles * sizeof(int));
+    }
+    pthread_create(&threads[dev], NULL, device_worker, w);
   }
-  if (print_stats) timer_stop_and_log("[photomosaic] write time");
+  for (int dev = 0; dev < host->num_devs; ++dev) pthread_join(threads[dev], NULL);
+  pthread_mutex_destroy(&s.lock);
 
-  if (print_stats) timer_start();
-  for (int dev = 0; dev < num_gpus; ++dev) {
-    int num_images = partitions[dev + 1] - partitions[dev];
-    int num_data = CIFAR10_SIZE;
-    clSetKernelArg(kernel, 0, sizeof(cl_mem), &buf_image[dev]);
-    clSetKernelArg(kernel, 1, sizeof(cl_mem), &buf_dataset[dev]);
-    clSetKernelArg(kernel, 2, sizeof(cl_mem), &buf_indices[dev]);
-    clSetKernelArg(kernel, 3, sizeof(int), &num_images);
-    clSetKernelArg(kernel, 4, sizeof(int), &num_data);
-
-    size_t global_size = (partitions[dev + 1] - partitions[dev]) * 256;
-    size_t local_size = 256;
-    clEnqueueNDRangeKernel(host->kernel_queues[dev], kernel, 1, NULL, &global_size, &local_size, 0,
-                           NULL, NULL);
+  if (sharded) {
+    // Min-loc over the shards; they are in dataset order, so ties keep the lowest index
+    for (int i = 0; i < num_tiles; ++i) {
+      dists[i] = MAX_DIST + 1;  // Loses to any image, for a caller with an empty shard
+      indices[i] = data_begin;
+      for (int dev = 0; dev < host->num_devs; ++dev) {
+        DeviceWorker *w = &workers[dev];
+        if (w->num_tiles == 0 || w->dists[i] >= dists[i]) continue;
+        dists[i] = w->dists[i];
+        indices[i] = w->indices[i];
+      }
+    }
   }
-  cl_all_finish(host->kernel_queues, num_gpus);
-  if (print_stats) timer_stop_and_log("[photomosaic] kernel time");
+  if (print_stats) {
+    timer_stop_and_log("[photomosaic] match time");
+    for (int dev = 0; dev < host->num_devs; ++dev) {
+      DeviceWorker *w = &workers[dev];
+      if (w->num_tiles == 0) continue;
+      if (sharded) {
+        log_info("[photomosaic] device %d (%s): images %d to %d for %d tiles in %.1f ms",
+                 host->devs[dev].index, host->devs[dev].name, w->data_begin, w->data_end,
+                 w->num_tiles, w->busy * 1e3);
+      } else {
+        log_info("[photomosaic] device %d (%s): %d tiles in %.1f ms, %.1f tiles/s",
+                 host->devs[dev].index, host->devs[dev].name, w->num_tiles, w->busy * 1e3,
+                 w->busy > 0 ? w->num_tiles / w->busy : 0.0);
+      }
+    }
+  }
+  for (int dev = 0; dev < host->num_devs; ++dev) {
+    free(workers[dev].indices);
+    free(workers[dev].dists);
+  }
+  free(threads);
+  free(workers);
+  if (print_stats && s.strategy == MATCH_PYRAMID) {
+    log_debug("[photomosaic] full SSD changed the 8x8 thumbnail winner for %d of %d tiles",
+              s.num_changed, num_tiles);
+  }
+}
 
-  if (print_stats) timer_start();
-  for (int dev = 0; dev < num_gpus; ++dev) {
-    int num_bytes = (partitions[dev + 1] - partitions[dev]) * sizeof(int);
-    clEnqueueReadBuffer(host->read_queues[dev], buf_indices[dev], CL_TRUE, 0, num_bytes,
-                        indices + partitions[dev], 0, NULL, NULL);
+void photomosaic_opencl(CLHost *host, unsigned char *image, const Dataset *dataset, int *indices,
+                        int num_tiles, bool print_stats) {
+  if (host->num_devs > 1 && num_tiles < MIN_GPU_QUOTA * host->num_devs) {
+    if (print_stats) log_debug("[photomosaic] few tiles; the devices split the dataset instead");
+    int *dists = (int *)malloc(num_tiles * sizeof(int));
+    run_schedule(host, image, dataset, 0, dataset->count, indices, dists, num_tiles, true,
+                 print_stats);
+    free(dists);
+  } else {
+    run_schedule(host, image, dataset, 0, dataset->count, indices, NULL, num_tiles, false,
+                 print_stats);
   }
-  if (print_stats) timer_stop_and_log("[photomosaic] read time");
+}
+
+void photomosaic_opencl_shard(CLHost *host, unsigned char *image, const Dataset *dataset,
+                              int data_begin, int data_end, int *indices, int *dists,
+                              int num_tiles, bool print_stats) {
+  run_schedule(host, image, dataset, data_begin, data_end, indices, dists, num_tiles, true,
+               print_stats);
 }
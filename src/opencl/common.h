@@ -1,22 +1,54 @@
 #pragma once
 
+#include <dataset.h>
 #include <stdbool.h>
 #include "clwrapper.h"
 
-#ifndef NUM_GPUS
-#define NUM_GPUS 4
-#endif
-
+/**
+ * One selected OpenCL device. Devices may come from different platforms, which cannot share a
+ * context, so each one has its own context, programs and buffers.
+ */
 typedef struct {
-  cl_platform_id platform;
-  cl_device_id devs[NUM_GPUS];
+  cl_device_id id;
+  int index;  // Position among the devices of every platform, as -g counts them
+  cl_device_type type;
+  char name[128];
   cl_context ctx;
-  cl_command_queue read_queues[NUM_GPUS];
-  cl_command_queue kernel_queues[NUM_GPUS];
-  cl_command_queue write_queues[NUM_GPUS];
+  cl_command_queue read_queue;
+  cl_command_queue kernel_queue;
+  cl_command_queue write_queue;
+
+  // Built or uploaded on first use and kept until release_host(), so that a host reused across
+  // images compiles and uploads once
+  cl_program tiling_program;
+  cl_program photomosaic_program;
+  cl_mem dataset_buffer;
+  cl_event *uploads;  // Transfer event of each dataset block until all are known to be complete
+  int num_uploads;
+} CLDevice;
+
+typedef struct {
+  int num_devs;
+  CLDevice *devs;
+  const Dataset *dataset;  // Dataset held by the devices' dataset_buffer
 } CLHost;
 
+/**
+ * Enumerate the devices of every platform and set up the ones options.devices selects
+ */
 CLHost create_host(bool print_stats);
+void release_host(CLHost *host);
 void preprocess_image(CLHost *host, unsigned char *image, int width, int height, bool print_stats);
-void photomosaic_opencl(CLHost *host, unsigned char *image, const unsigned char *dataset,
-                        int *indices, int num_tiles, bool print_stats);
\ No newline at end of file
+/**
+ * Match every tile to its closest dataset image. Devices split the tiles, or the dataset when
+ * there are too few tiles to keep them all busy.
+ */
+void photomosaic_opencl(CLHost *host, unsigned char *image, const Dataset *dataset, int *indices,
+                        int num_tiles, bool print_stats);
+/**
+ * Match every tile against dataset images [data_begin, data_end) only, split across the devices
+ * @param dists receives each tile's distance to its match, to merge with the other shards
+ */
+void photomosaic_opencl_shard(CLHost *host, unsigned char *image, const Dataset *dataset,
+                              int data_begin, int data_end, int *indices, int *dists,
+                              int num_tiles, bool print_stats);
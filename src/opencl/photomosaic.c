@@ -1,5 +1,6 @@
 #include <log/log.h>
 #include <photomosaic.h>
+#include <stdlib.h>
 #include <util.h>
 #include "clwrapper.h"
 #include "common.h"
@@ -8,16 +9,39 @@
 #define H 32
 #define C 3
 #define TILE_LEN (W * H * C)
-#define CIFAR10_SIZE 60000
 #define MIN_GPU_QUOTA 16
 
-void photomosaic(unsigned char *image, int width, int height, const unsigned char *dataset,
-                 int *indices) {
+struct Photomosaic {
+  CLHost host;
+  const Dataset *dataset;
+};
+
+Photomosaic *photomosaic_create(const Dataset *dataset) {
   log_info("=================================");
   log_info("Photomosaic OpenCL implementation");
   log_info("=================================");
 
-  CLHost host = create_host(true);
-  preprocess_image(&host, image, width, height, true);
-  photomosaic_opencl(&host, image, dataset, indices, (width / W) * (height / H), true);
+  Photomosaic *mosaic = (Photomosaic *)malloc(sizeof(Photomosaic));
+  mosaic->host = create_host(true);
+  mosaic->dataset = dataset;
+  return mosaic;
+}
+
+void photomosaic_run(Photomosaic *mosaic, unsigned char *image, int width, int height,
+                     int *indices) {
+  preprocess_image(&mosaic->host, image, width, height, true);
+  photomosaic_opencl(&mosaic->host, image, mosaic->dataset, indices, (width / W) * (height / H),
+                     true);
+}
+
+void photomosaic_destroy(Photomosaic *mosaic) {
+  release_host(&mosaic->host);
+  free(mosaic);
+}
+
+void photomosaic(unsigned char *image, int width, int height, const Dataset *dataset,
+                 int *indices) {
+  Photomosaic *mosaic = photomosaic_create(dataset);
+  photomosaic_run(mosaic, image, width, height, indices);
+  photomosaic_destroy(mosaic);
 }
@@ -3,36 +3,31 @@
 #define C 3
 #define TILE_LEN ((W * H * C) / 4)
 #define WORK_ITEM_SIZE 256
-#define TILES 1
+#define TILES 4  // Image tiles per work-group in photomosaic_tiles
+#define SLICE 16  // uchar4 of every candidate staged per step in photomosaic_tiles
 #define WORK_LOAD (TILE_LEN / WORK_ITEM_SIZE)
 #define MAX_DIST (W * H * C * 255 * 255)
+#define THUMB_W 8
+#define THUMB_H 8
+#define THUMB_LEN (THUMB_W * THUMB_H * C)
+#define THUMB_BLOCK ((W / THUMB_W) * (H / THUMB_H))
 
-__kernel void 
-photomosaic(
-  __global uchar4 *image,
+/**
+ * Compare the cached image tile against dataset images [first, last) and update the running
+ * minimum held by work-item 0
+ */
+void scan_dataset(
   __global uchar4 *dataset,
-  __global int *indices,
-  int num_images,
-  int num_data
+  __local int4 *image_cache,
+  __local int *reduce_sum,
+  int first,
+  int last,
+  int *min_dist,
+  int *min_index
 ) {
-  int gid = get_group_id(0);
   int lid = get_local_id(0);
-  
-  __local int4 image_cache[TILE_LEN];
-  __local int reduce_sum[WORK_ITEM_SIZE];
-  
-  int min_index = 0;
-  int min_dist = MAX_DIST;
-
-  #pragma unroll
-  for (int k = 0; k < WORK_LOAD; ++k) {
-    image_cache[lid*WORK_LOAD + k] 
-      = convert_int4(image[gid*TILE_LEN + lid*WORK_LOAD + k]);
-  }
 
-  barrier(CLK_LOCAL_MEM_FENCE);
-
-  for (int i = 0; i < num_data; ++i) {
+  for (int i = first; i < last; ++i) {
 
     int4 sum = (int4)(0);
     #pragma unroll
@@ -58,16 +53,313 @@ photomosaic(
 
     if (lid == 0) {
       int dist = reduce_sum[0];
-      if (dist < min_dist) {
-        min_dist = dist;
-        min_index = i;
+      if (dist < *min_dist) {
+        *min_dist = dist;
+        *min_index = i;
       }
     }
   }
+}
+
+void cache_image(
+  __global uchar4 *image,
+  __local int4 *image_cache
+) {
+  int gid = get_group_id(0);
+  int lid = get_local_id(0);
+
+  #pragma unroll
+  for (int k = 0; k < WORK_LOAD; ++k) {
+    image_cache[lid*WORK_LOAD + k] 
+      = convert_int4(image[gid*TILE_LEN + lid*WORK_LOAD + k]);
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+__kernel void 
+photomosaic(
+  __global uchar4 *image,
+  __global uchar4 *dataset,
+  __global int *indices,
+  int num_images,
+  int num_data
+) {
+  int gid = get_group_id(0);
+  int lid = get_local_id(0);
+  
+  __local int4 image_cache[TILE_LEN];
+  __local int reduce_sum[WORK_ITEM_SIZE];
+  
+  int min_index = 0;
+  int min_dist = MAX_DIST;
+
+  cache_image(image, image_cache);
+  scan_dataset(dataset, image_cache, reduce_sum, 0, num_data, &min_dist, &min_index);
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (lid == 0) {
+    indices[gid] = min_index;
+  }
+}
+
+/**
+ * Scan one block of the dataset for every image tile. The host launches this once per block so
+ * that all work-groups share the same block in device cache; the running minimum of each tile is
+ * carried between launches in min_dists and indices.
+ */
+__kernel void 
+photomosaic_block(
+  __global uchar4 *image,
+  __global uchar4 *dataset,
+  __global int *indices,
+  __global int *min_dists,
+  int num_images,
+  int block_begin,
+  int block_end
+) {
+  int gid = get_group_id(0);
+  int lid = get_local_id(0);
+  
+  __local int4 image_cache[TILE_LEN];
+  __local int reduce_sum[WORK_ITEM_SIZE];
+  
+  int min_index = indices[gid];
+  int min_dist = min_dists[gid];
+
+  cache_image(image, image_cache);
+  scan_dataset(dataset, image_cache, reduce_sum, block_begin, block_end, &min_dist, &min_index);
 
   barrier(CLK_LOCAL_MEM_FENCE);
 
   if (lid == 0) {
     indices[gid] = min_index;
+    min_dists[gid] = min_dist;
+  }
+}
+
+/**
+ * Whether (dist, index) is lexicographically smaller than (best_dist, best_index)
+ */
+bool beats(int dist, int index, int best_dist, int best_index) {
+  return dist < best_dist || (dist == best_dist && index < best_index);
+}
+
+/**
+ * Lexicographic min-loc reduction over the work-group; the result ends up in slot 0
+ */
+void reduce_min_loc(__local int *dists, __local int *indices) {
+  int lid = get_local_id(0);
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (int p = WORK_ITEM_SIZE / 2; p > 0; p >>= 1) {
+    if (lid < p && beats(dists[lid + p], indices[lid + p], dists[lid], indices[lid])) {
+      dists[lid] = dists[lid + p];
+      indices[lid] = indices[lid + p];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+}
+
+/**
+ * Lower bound of the full distance from 8x8 thumbnails of 4x4 block sums
+ */
+int thumb_bound(__global ushort *thumb, __local int *image_thumb) {
+  uint sum = 0;
+  for (int k = 0; k < THUMB_LEN; ++k) {
+    int d = (int)thumb[k] - image_thumb[k];
+    sum += (uint)(d * d);
+  }
+  return (int)(sum / THUMB_BLOCK);
+}
+
+/**
+ * Coarse-to-fine exact search. The work-group finds the candidate with the smallest thumbnail
+ * bound and measures it exactly; then every work-item independently checks its own strided
+ * share of the dataset, running the full distance only where the bound allows it. Ties resolve
+ * to the lowest index, so the result equals the photomosaic kernel.
+ */
+__kernel void 
+photomosaic_pyramid(
+  __global uchar4 *image,
+  __global uchar4 *dataset,
+  __global ushort *thumbs,
+  __global int *indices,
+  __global int *coarse,
+  int num_images,
+  int num_data
+) {
+  int gid = get_group_id(0);
+  int lid = get_local_id(0);
+
+  __local int4 image_cache[TILE_LEN];
+  __local int image_thumb[THUMB_LEN];
+  __local int reduce_sum[WORK_ITEM_SIZE];
+  __local int reduce_index[WORK_ITEM_SIZE];
+  __local int seed_dist;
+
+  cache_image(image, image_cache);
+
+  // Each 4x4 block row is a single uchar4
+  if (lid < THUMB_LEN) {
+    int c = lid / (THUMB_W * THUMB_H);
+    int by = (lid / THUMB_W) % THUMB_H;
+    int bx = lid % THUMB_W;
+    int sum = 0;
+    for (int h = 0; h < H / THUMB_H; ++h) {
+      int4 v = image_cache[((c * H + by * (H / THUMB_H) + h) * W + bx * (W / THUMB_W)) / 4];
+      sum += v.x + v.y + v.z + v.w;
+    }
+    image_thumb[lid] = sum;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // Level 1: smallest thumbnail bound
+  int best_lb = INT_MAX;
+  int best_i = INT_MAX;
+  for (int i = lid; i < num_data; i += WORK_ITEM_SIZE) {
+    int lb = thumb_bound(thumbs + i * THUMB_LEN, image_thumb);
+    if (lb < best_lb) {
+      best_lb = lb;
+      best_i = i;
+    }
+  }
+  reduce_sum[lid] = best_lb;
+  reduce_index[lid] = best_i;
+  reduce_min_loc(reduce_sum, reduce_index);
+  int seed = reduce_index[0];
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // Exact distance of the seed bounds everything else
+  int min_dist = MAX_DIST;
+  int min_index = 0;
+  scan_dataset(dataset, image_cache, reduce_sum, seed, seed + 1, &min_dist, &min_index);
+  if (lid == 0) seed_dist = min_dist;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // Level 2: full distance on the candidates whose bound may still win
+  min_dist = seed_dist;
+  min_index = seed;
+  for (int i = lid; i < num_data; i += WORK_ITEM_SIZE) {
+    if (i == seed) continue;
+    if (!beats(thumb_bound(thumbs + i * THUMB_LEN, image_thumb), i, min_dist, min_index))
+      continue;
+    int sum = 0;
+    for (int k = 0; k < TILE_LEN && sum <= min_dist; k += WORK_ITEM_SIZE / 4) {
+      for (int j = k; j < k + WORK_ITEM_SIZE / 4; ++j) {
+        int4 d = convert_int4(dataset[i*TILE_LEN + j]) - image_cache[j];
+        int4 sq = d * d;
+        sum += sq.x + sq.y + sq.z + sq.w;
+      }
+    }
+    if (beats(sum, i, min_dist, min_index)) {
+      min_dist = sum;
+      min_index = i;
+    }
+  }
+  reduce_sum[lid] = min_dist;
+  reduce_index[lid] = min_index;
+  reduce_min_loc(reduce_sum, reduce_index);
+
+  if (lid == 0) {
+    indices[gid] = reduce_index[0];
+    coarse[gid] = seed;
+  }
+}
+
+/**
+ * Register-blocked variant of photomosaic_block: a work-group matches TILES image tiles at once,
+ * and each work-item owns one candidate of every 256-image step, keeping its distance to all
+ * TILES tiles in registers. Candidates are staged SLICE words at a time in local memory with
+ * coalesced loads, so each dataset word read from global memory is used TILES times, and the
+ * work-group synchronises twice per slice instead of nine times per candidate. A single min-loc
+ * reduction per tile at the end merges the work-items and the running minimum of earlier blocks.
+ */
+__kernel void 
+photomosaic_tiles(
+  __global uchar4 *image,
+  __global uchar4 *dataset,
+  __global int *indices,
+  __global int *min_dists,
+  int num_images,
+  int block_begin,
+  int block_end
+) {
+  int gid = get_group_id(0);
+  int lid = get_local_id(0);
+
+  __local uchar4 tiles[TILES][TILE_LEN];
+  __local uchar4 stage[WORK_ITEM_SIZE * (SLICE + 1)];  // Padded so that reads avoid bank conflicts
+  __local int reduce_dist[WORK_ITEM_SIZE];
+  __local int reduce_index[WORK_ITEM_SIZE];
+
+  int first = gid * TILES;
+  int count = min(TILES, num_images - first);
+  for (int k = lid; k < TILES * TILE_LEN; k += WORK_ITEM_SIZE) {
+    tiles[k / TILE_LEN][k % TILE_LEN] =
+      k / TILE_LEN < count ? image[first*TILE_LEN + k] : (uchar4)(0);
+  }
+
+  int best_dist[TILES];
+  int best_index[TILES];
+  #pragma unroll
+  for (int t = 0; t < TILES; ++t) {
+    best_dist[t] = INT_MAX;
+    best_index[t] = INT_MAX;
+  }
+
+  for (int base = block_begin; base < block_end; base += WORK_ITEM_SIZE) {
+    int sum[TILES];
+    #pragma unroll
+    for (int t = 0; t < TILES; ++t) {
+      sum[t] = 0;
+    }
+
+    for (int slice = 0; slice < TILE_LEN; slice += SLICE) {
+      // The previous slice is consumed (and, the first time, the tiles are cached)
+      barrier(CLK_LOCAL_MEM_FENCE);
+      for (int k = lid; k < WORK_ITEM_SIZE * SLICE; k += WORK_ITEM_SIZE) {
+        int c = k / SLICE;
+        int w = k % SLICE;
+        stage[c * (SLICE + 1) + w] =
+          base + c < block_end ? dataset[(base + c)*TILE_LEN + slice + w] : (uchar4)(0);
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      #pragma unroll
+      for (int w = 0; w < SLICE; ++w) {
+        int4 v = convert_int4(stage[lid * (SLICE + 1) + w]);
+        #pragma unroll
+        for (int t = 0; t < TILES; ++t) {
+          int4 d = v - convert_int4(tiles[t][slice + w]);
+          int4 sq = d * d;
+          sum[t] += sq.x + sq.y + sq.z + sq.w;
+        }
+      }
+    }
+
+    // Each work-item visits its candidates in increasing order, so < keeps the lowest index
+    if (base + lid < block_end) {
+      #pragma unroll
+      for (int t = 0; t < TILES; ++t) {
+        if (sum[t] < best_dist[t]) {
+          best_dist[t] = sum[t];
+          best_index[t] = base + lid;
+        }
+      }
+    }
+  }
+
+  for (int t = 0; t < TILES; ++t) {
+    reduce_dist[lid] = best_dist[t];
+    reduce_index[lid] = best_index[t];
+    reduce_min_loc(reduce_dist, reduce_index);
+    if (lid == 0 && t < count) {
+      // Earlier blocks hold lower indices, so the carried minimum wins ties
+      if (beats(reduce_dist[0], reduce_index[0], min_dists[first + t], indices[first + t])) {
+        min_dists[first + t] = reduce_dist[0];
+        indices[first + t] = reduce_index[0];
+      }
+    }
   }
 }
@@ -0,0 +1,14 @@
+#pragma once
+
+/**
+ * Lower bound of the SSD between two 32x32x3 tiles from their channel sums: each channel of n
+ * pixels contributes at least (sum_a - sum_b)^2 / n by Cauchy-Schwarz
+ */
+static inline int mean_bound(const int *sums_a, const int *sums_b) {
+  long long sum = 0;
+  for (int c = 0; c < 3; ++c) {
+    long long d = sums_a[c] - sums_b[c];
+    sum += d * d;
+  }
+  return (int)(sum / (32 * 32));
+}
@@ -0,0 +1,246 @@
+#include "gemm.h"
+#include <immintrin.h>
+#include <limits.h>
+#include <log/log.h>
+#include <omp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define W 32
+#define H 32
+#define C 3
+#define TILE_LEN (H * W * C)
+
+// Micro-kernel computes an MR x NR block of dot products; NR is one 512-bit register of int32
+// pairs. Dataset images are packed NB at a time, tiles are visited TB at a time and the depth is
+// split into KC long passes so that one packed micro-panel (KC x NR bytes) stays in L1.
+#define MR 4
+#define NR 32
+#define KC 1024
+#define NB 256
+#define TB 64
+
+/**
+ * C[MR][NR] += A[MR][kc] * B[kc][NR]
+ * @param a unsigned tile bytes, rows are TILE_LEN apart
+ * @param b signed dataset bytes packed as [kc / g][NR][g] where g is the kernel's depth group
+ * @param ldc row stride of c
+ */
+typedef void (*MicroKernel)(const unsigned char *a, const signed char *b, int kc, int *c,
+                            int ldc);
+
+/**
+ * Portable kernel with depth group 1; the NR wide inner loop is left to the auto-vectorizer
+ */
+__attribute__((target_clones("avx2", "default"))) static void micro_kernel_generic(
+    const unsigned char *a, const signed char *b, int kc, int *c, int ldc) {
+  int acc[MR][NR];
+  for (int r = 0; r < MR; r++) {
+    for (int j = 0; j < NR; j++) {
+      acc[r][j] = c[r * ldc + j];
+    }
+  }
+  for (int k = 0; k < kc; k++) {
+    const signed char *bk = b + k * NR;
+    for (int r = 0; r < MR; r++) {
+      int ak = a[r * TILE_LEN + k];
+      for (int j = 0; j < NR; j++) {
+        acc[r][j] += ak * bk[j];
+      }
+    }
+  }
+  for (int r = 0; r < MR; r++) {
+    for (int j = 0; j < NR; j++) {
+      c[r * ldc + j] = acc[r][j];
+    }
+  }
+}
+
+/**
+ * VPDPBUSD multiplies unsigned tile bytes with signed dataset bytes and accumulates groups of four
+ * into int32 lanes, so it uses depth group 4
+ */
+__attribute__((target("avx512f,avx512vnni"))) static void micro_kernel_vnni(
+    const unsigned char *a, const signed char *b, int kc, int *c, int ldc) {
+  __m512i acc[MR][2];
+  for (int r = 0; r < MR; r++) {
+    acc[r][0] = _mm512_loadu_si512((const void *)(c + r * ldc));
+    acc[r][1] = _mm512_loadu_si512((const void *)(c + r * ldc + 16));
+  }
+  for (int k = 0; k < kc; k += 4) {
+    __m512i b0 = _mm512_loadu_si512((const void *)(b + k * NR));
+    __m512i b1 = _mm512_loadu_si512((const void *)(b + k * NR + 64));
+    for (int r = 0; r < MR; r++) {
+      int quad;
+      memcpy(&quad, a + r * TILE_LEN + k, sizeof(int));
+      __m512i av = _mm512_set1_epi32(quad);
+      acc[r][0] = _mm512_dpbusd_epi32(acc[r][0], av, b0);
+      acc[r][1] = _mm512_dpbusd_epi32(acc[r][1], av, b1);
+    }
+  }
+  for (int r = 0; r < MR; r++) {
+    _mm512_storeu_si512((void *)(c + r * ldc), acc[r][0]);
+    _mm512_storeu_si512((void *)(c + r * ldc + 16), acc[r][1]);
+  }
+}
+
+/**
+ * Pack nb dataset images into KC x NR micro-panels with depth group g, shifting them to signed
+ * bytes (b - 128), and compute their squared norms on the way. Columns past nb are zero padded.
+ */
+static void pack_dataset(signed char *packed, int *sq_norms, const unsigned char *dataset, int nb,
+                         int g) {
+  memset(packed, 0, NB * TILE_LEN);
+  for (int j = 0; j < nb; j++) {
+    const unsigned char *src = dataset + (size_t)j * TILE_LEN;
+    int jp = j - j % NR;
+    int sq = 0;
+    for (int k = 0; k < TILE_LEN; k++) {
+      int kb = k - k % KC;
+      int v = src[k];
+      sq += v * v;
+      packed[kb * NB + jp * KC + ((k - kb) / g) * NR * g + (j - jp) * g + k % g] =
+          (signed char)(v - 128);
+    }
+    sq_norms[j] = sq;
+  }
+}
+
+static inline int better(int d, int i, int best_d, int best_i) {
+  return d < best_d || (d == best_d && i < best_i);
+}
+
+struct GemmPanels {
+  signed char *packed;  // NB images per block, each block laid out by pack_dataset()
+  int *sq_norms;
+  int num_data;
+  MicroKernel kernel;
+};
+
+GemmPanels *gemm_pack(const unsigned char *dataset, int num_data) {
+  __builtin_cpu_init();
+  MicroKernel kernel = micro_kernel_generic;
+  const char *kernel_name = "generic";
+  int group = 1;
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vnni")) {
+    kernel = micro_kernel_vnni;
+    kernel_name = "avx512vnni";
+    group = 4;
+  }
+  log_info("GEMM micro-kernel: %s", kernel_name);
+
+  int num_blocks = (num_data + NB - 1) / NB;
+  GemmPanels *panels = (GemmPanels *)malloc(sizeof(GemmPanels));
+  panels->packed = (signed char *)malloc((size_t)num_blocks * NB * TILE_LEN);
+  panels->sq_norms = (int *)malloc((size_t)num_blocks * NB * sizeof(int));
+  panels->num_data = num_data;
+  panels->kernel = kernel;
+#pragma omp parallel for schedule(static)
+  for (int b = 0; b < num_blocks; b++) {
+    int j0 = b * NB;
+    int nb = num_data - j0 < NB ? num_data - j0 : NB;
+    pack_dataset(panels->packed + (size_t)j0 * TILE_LEN, panels->sq_norms + j0,
+                 dataset + (size_t)j0 * TILE_LEN, nb, group);
+  }
+  return panels;
+}
+
+void gemm_free(GemmPanels *panels) {
+  free(panels->packed);
+  free(panels->sq_norms);
+  free(panels);
+}
+
+void gemm_match(const unsigned char *tiles, int num_tiles, const GemmPanels *panels,
+                int *indices) {
+  int num_data = panels->num_data;
+  MicroKernel kernel = panels->kernel;
+
+  // Zero-padded copy of the tiles so that every micro-kernel sees MR full rows
+  int padded_tiles = (num_tiles + TB - 1) / TB * TB;
+  unsigned char *a = (unsigned char *)calloc((size_t)padded_tiles * TILE_LEN, 1);
+  memcpy(a, tiles, (size_t)num_tiles * TILE_LEN);
+
+  // Since b is shifted by -128, a.b = a.(b - 128) + 128 * sum(a)
+  int *sq_norms_a = (int *)malloc(num_tiles * sizeof(int));
+  int *sums_a = (int *)malloc(num_tiles * sizeof(int));
+  for (int i = 0; i < num_tiles; i++) {
+    int sq = 0, sum = 0;
+    for (int k = 0; k < TILE_LEN; k++) {
+      int v = tiles[(size_t)i * TILE_LEN + k];
+      sq += v * v;
+      sum += v;
+    }
+    sq_norms_a[i] = sq;
+    sums_a[i] = sum;
+  }
+
+  for (int i = 0; i < num_tiles; i++) {
+    indices[i] = INT_MAX;
+  }
+  int *min_dists = (int *)malloc(num_tiles * sizeof(int));
+  for (int i = 0; i < num_tiles; i++) {
+    min_dists[i] = INT_MAX;
+  }
+
+#pragma omp parallel
+  {
+    int *c = (int *)malloc(TB * NB * sizeof(int));
+    int *best_d = (int *)malloc(num_tiles * sizeof(int));
+    int *best_i = (int *)malloc(num_tiles * sizeof(int));
+    for (int i = 0; i < num_tiles; i++) {
+      best_d[i] = INT_MAX;
+      best_i[i] = INT_MAX;
+    }
+
+#pragma omp for schedule(dynamic)
+    for (int j0 = 0; j0 < num_data; j0 += NB) {
+      int nb = num_data - j0 < NB ? num_data - j0 : NB;
+      const signed char *packed = panels->packed + (size_t)j0 * TILE_LEN;
+      const int *sq_norms_b = panels->sq_norms + j0;
+
+      for (int i0 = 0; i0 < num_tiles; i0 += TB) {
+        memset(c, 0, TB * NB * sizeof(int));
+        for (int kb = 0; kb < TILE_LEN; kb += KC) {
+          for (int jp = 0; jp < NB; jp += NR) {
+            for (int ir = 0; ir < TB; ir += MR) {
+              kernel(a + (size_t)(i0 + ir) * TILE_LEN + kb, packed + kb * NB + jp * KC, KC,
+                     c + ir * NB + jp, NB);
+            }
+          }
+        }
+
+        // Fused argmin epilogue
+        int tb = num_tiles - i0 < TB ? num_tiles - i0 : TB;
+        for (int ir = 0; ir < tb; ir++) {
+          int i = i0 + ir;
+          for (int j = 0; j < nb; j++) {
+            int dot = c[ir * NB + j] + 128 * sums_a[i];
+            int d = sq_norms_a[i] + sq_norms_b[j] - 2 * dot;
+            if (better(d, j0 + j, best_d[i], best_i[i])) {
+              best_d[i] = d;
+              best_i[i] = j0 + j;
+            }
+          }
+        }
+      }
+    }
+
+#pragma omp critical
+    for (int i = 0; i < num_tiles; i++) {
+      if (better(best_d[i], best_i[i], min_dists[i], indices[i])) {
+        min_dists[i] = best_d[i];
+        indices[i] = best_i[i];
+      }
+    }
+
+    free(c);
+    free(best_d);
+    free(best_i);
+  }
+
+  free(a);
+  free(sq_norms_a);
+  free(sums_a);
+  free(min_dists);
+}
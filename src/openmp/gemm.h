@@ -0,0 +1,24 @@
+#pragma once
+
+/**
+ * Dataset images packed once into the micro-kernel's layout, shifted to signed bytes, with their
+ * squared norms
+ */
+typedef struct GemmPanels GemmPanels;
+
+/**
+ * @param dataset num_data CHW images of length TILE_LEN each
+ */
+GemmPanels *gemm_pack(const unsigned char *dataset, int num_data);
+void gemm_free(GemmPanels *panels);
+
+/**
+ * Find the nearest dataset image of every tile by recasting the search as
+ * ||a||^2 + ||b||^2 - 2 a.b over a (num_tiles x TILE_LEN) by (TILE_LEN x num_data) product.
+ * Ties resolve to the lowest dataset index, the same as the linear scan.
+ * @param tiles CHW tiles of length TILE_LEN each
+ * @param panels from gemm_pack()
+ * @param indices output dataset index for each tile
+ */
+void gemm_match(const unsigned char *tiles, int num_tiles, const GemmPanels *panels,
+                int *indices);
@@ -0,0 +1,83 @@
+#include "ivf.h"
+#include <limits.h>
+#include <log/log.h>
+#include <omp.h>
+#include <stdlib.h>
+#include "bounds.h"
+#include "topk.h"
+
+#define W 32
+#define H 32
+#define C 3
+#define TILE_LEN (H * W * C)
+
+typedef struct {
+  int dist;
+  int list;
+} Probe;
+
+static int compare_probes(const void *a, const void *b) {
+  const Probe *pa = (const Probe *)a, *pb = (const Probe *)b;
+  if (pa->dist != pb->dist) return pa->dist < pb->dist ? -1 : 1;
+  return pa->list - pb->list;
+}
+
+void ivf_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset, SSDKernel ssd,
+               int nprobe, int *indices) {
+  size_t centroids_size, offsets_size;
+  const unsigned char *centroids = dataset_section(dataset, SECTION_IVF_CENTROIDS, &centroids_size);
+  const int *offsets = dataset_section(dataset, SECTION_IVF_OFFSETS, &offsets_size);
+  const int *ids = dataset_section(dataset, SECTION_IVF_IDS, NULL);
+  if (centroids == NULL || offsets == NULL || ids == NULL) {
+    log_error("The dataset has no IVF index; rebuild it with build_index -i <nlist>");
+    exit(EXIT_FAILURE);
+  }
+  int nlist = centroids_size / TILE_LEN;
+  if (nprobe > nlist) nprobe = nlist;
+  if (nprobe < 1) nprobe = 1;
+  log_debug("[photomosaic] IVF probes %d of %d lists", nprobe, nlist);
+
+  long long num_scanned = 0;
+#pragma omp parallel reduction(+ : num_scanned)
+  {
+    Probe *probes = (Probe *)malloc(nlist * sizeof(Probe));
+
+#pragma omp for schedule(dynamic)
+    for (int t = 0; t < num_tiles; ++t) {
+      const unsigned char *tile = tiles + (size_t)t * TILE_LEN;
+      int sums[C] = {0, 0, 0};
+      for (int k = 0; k < TILE_LEN; ++k) {
+        sums[k / (H * W)] += tile[k];
+      }
+      for (int c = 0; c < nlist; ++c) {
+        probes[c].dist = ssd(tile, centroids + (size_t)c * TILE_LEN, TILE_LEN, INT_MAX);
+        probes[c].list = c;
+      }
+      qsort(probes, nlist, sizeof(Probe), compare_probes);
+
+      // Lists hold ascending indices but are visited out of order, so ties compare indices
+      int min_dist = INT_MAX, min_i = 0;
+      for (int p = 0; p < nprobe; ++p) {
+        int list = probes[p].list;
+        for (int k = offsets[list]; k < offsets[list + 1]; ++k) {
+          int i = ids[k];
+          int lb = mean_bound(sums, dataset->sums + i * C);
+          if (lb > min_dist || (lb == min_dist && i > min_i)) continue;
+          int threshold = min_dist == INT_MAX ? INT_MAX : min_dist + 1;
+          int d = ssd(tile, dataset->tiles + (size_t)i * TILE_LEN, TILE_LEN, threshold);
+          if (beats(d, i, min_dist, min_i)) {
+            min_dist = d;
+            min_i = i;
+          }
+        }
+        num_scanned += offsets[list + 1] - offsets[list];
+      }
+      indices[t] = min_i;
+    }
+
+    free(probes);
+  }
+
+  log_debug("[photomosaic] IVF scanned %.1f candidates per tile on average",
+            num_tiles > 0 ? (double)num_scanned / num_tiles : 0.0);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <dataset.h>
+#include "ssd.h"
+
+/**
+ * Approximate search over the IVF (k-means inverted file) sections of the index: each tile
+ * is compared only with the images in the nprobe clusters whose centroids are nearest to it
+ * @param tiles CHW tiles of length TILE_LEN each
+ * @param indices output dataset index for each tile
+ */
+void ivf_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset, SSDKernel ssd,
+               int nprobe, int *indices);
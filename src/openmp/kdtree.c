@@ -0,0 +1,127 @@
+#include "kdtree.h"
+#include <stdlib.h>
+
+#define KD_LEAF 8
+#define KD_MAX_K 64
+
+typedef struct {
+  const KDTree *tree;
+  const int *query;
+  int k;
+  int size;
+  long long dists[KD_MAX_K];
+  int ids[KD_MAX_K];
+} KDSearch;
+
+static inline long long sq_dist(const int *a, const int *b, int dim) {
+  long long sum = 0;
+  for (int c = 0; c < dim; ++c) {
+    long long d = a[c] - b[c];
+    sum += d * d;
+  }
+  return sum;
+}
+
+static inline int closer(long long d, int i, long long best_d, int best_i) {
+  return d < best_d || (d == best_d && i < best_i);
+}
+
+/**
+ * Insert into the sorted list of the k nearest so far
+ */
+static void offer(KDSearch *s, int i) {
+  long long d = sq_dist(s->query, s->tree->points + (size_t)i * s->tree->dim, s->tree->dim);
+  if (s->size == s->k && !closer(d, i, s->dists[s->k - 1], s->ids[s->k - 1])) return;
+  int p = s->size < s->k ? s->size++ : s->k - 1;
+  while (p > 0 && closer(d, i, s->dists[p - 1], s->ids[p - 1])) {
+    s->dists[p] = s->dists[p - 1];
+    s->ids[p] = s->ids[p - 1];
+    p--;
+  }
+  s->dists[p] = d;
+  s->ids[p] = i;
+}
+
+static void search_range(KDSearch *s, int lo, int hi, int depth) {
+  const KDTree *tree = s->tree;
+  if (hi - lo <= KD_LEAF) {
+    for (int k = lo; k < hi; ++k) {
+      offer(s, tree->ids[k]);
+    }
+    return;
+  }
+  int mid = (lo + hi) / 2;
+  int axis = depth % tree->dim;
+  int pivot = tree->ids[mid];
+  offer(s, pivot);
+  long long diff = (long long)s->query[axis] - tree->points[(size_t)pivot * tree->dim + axis];
+  int near_lo = diff < 0 ? lo : mid + 1, near_hi = diff < 0 ? mid : hi;
+  int far_lo = diff < 0 ? mid + 1 : lo, far_hi = diff < 0 ? hi : mid;
+  search_range(s, near_lo, near_hi, depth + 1);
+  // Equal distances must still be visited for the lowest-index tie-break
+  if (s->size < s->k || diff * diff <= s->dists[s->k - 1]) {
+    search_range(s, far_lo, far_hi, depth + 1);
+  }
+}
+
+static int compare_keys(const void *a, const void *b) {
+  long long ka = *(const long long *)a, kb = *(const long long *)b;
+  return ka < kb ? -1 : ka > kb;
+}
+
+/**
+ * Sort ids by their coordinate on axis, ties by index. The order is carried by the keys instead
+ * of a comparator context, so that trees can be built from several threads.
+ * @param keys scratch buffer of n
+ */
+static void sort_axis(const KDTree *tree, int *ids, int n, int axis, long long *keys) {
+  for (int k = 0; k < n; ++k) {
+    long long v = tree->points[(size_t)ids[k] * tree->dim + axis];
+    keys[k] = v * ((long long)1 << 32) + ids[k];
+  }
+  qsort(keys, n, sizeof(long long), compare_keys);
+  for (int k = 0; k < n; ++k) {
+    ids[k] = (int)(keys[k] & 0xffffffffLL);
+  }
+}
+
+static void build_range(KDTree *tree, int lo, int hi, int depth, long long *keys) {
+  if (hi - lo <= KD_LEAF) return;
+  sort_axis(tree, tree->ids + lo, hi - lo, depth % tree->dim, keys);
+  int mid = (lo + hi) / 2;
+  build_range(tree, lo, mid, depth + 1, keys);
+  build_range(tree, mid + 1, hi, depth + 1, keys);
+}
+
+KDTree *kdtree_build(const int *points, int count, int dim) {
+  KDTree *tree = (KDTree *)malloc(sizeof(KDTree));
+  tree->points = points;
+  tree->count = count;
+  tree->dim = dim;
+  tree->ids = (int *)malloc(count * sizeof(int));
+  for (int i = 0; i < count; ++i) {
+    tree->ids[i] = i;
+  }
+  long long *keys = (long long *)malloc(count * sizeof(long long));
+  build_range(tree, 0, count, 0, keys);
+  free(keys);
+  return tree;
+}
+
+void kdtree_free(KDTree *tree) {
+  free(tree->ids);
+  free(tree);
+}
+
+int kdtree_nearest(const KDTree *tree, const int *query, int k, int *ids) {
+  KDSearch s;
+  s.tree = tree;
+  s.query = query;
+  s.k = k < KD_MAX_K ? k : KD_MAX_K;
+  s.size = 0;
+  if (s.k > 0) search_range(&s, 0, tree->count, 0);
+  for (int p = 0; p < s.size; ++p) {
+    ids[p] = s.ids[p];
+  }
+  return s.size;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+/**
+ * Balanced k-d tree over small integer vectors, stored as a permutation of the point indices
+ * where the median of every range is the node splitting it
+ */
+typedef struct {
+  const int *points;  // count x dim
+  int count;
+  int dim;
+  int *ids;
+} KDTree;
+
+/**
+ * @param points count vectors of dim ints; must outlive the tree
+ */
+KDTree *kdtree_build(const int *points, int count, int dim);
+void kdtree_free(KDTree *tree);
+
+/**
+ * Find the k (at most 64) points nearest to query in squared L2, ties going to the lowest index
+ * @param ids output buffer of k indices, nearest first
+ * @return number of indices written, min(k, count)
+ */
+int kdtree_nearest(const KDTree *tree, const int *query, int k, int *ids);
@@ -0,0 +1,82 @@
+#include "ordered.h"
+#include <limits.h>
+#include <log/log.h>
+#include <omp.h>
+#include <stdlib.h>
+#include "bounds.h"
+
+#define W 32
+#define H 32
+#define C 3
+#define TILE_LEN (H * W * C)
+#define ORDER_BLOCK 64  // Bytes compared between early-abandon checks
+#define NUM_ORDER_BLOCKS (TILE_LEN / ORDER_BLOCK)
+
+typedef struct {
+  int score;
+  int offset;
+} OrderBlock;
+
+static int compare_blocks(const void *a, const void *b) {
+  const OrderBlock *ba = (const OrderBlock *)a, *bb = (const OrderBlock *)b;
+  if (ba->score != bb->score) return ba->score > bb->score ? -1 : 1;
+  return ba->offset - bb->offset;
+}
+
+/**
+ * Order the blocks of a tile by their energy around mid-grey. Extreme pixels are the ones most
+ * candidates disagree with, so they raise the running sum fastest.
+ * @param offsets output buffer of NUM_ORDER_BLOCKS byte offsets
+ */
+static void order_blocks(const unsigned char *tile, int *offsets) {
+  OrderBlock blocks[NUM_ORDER_BLOCKS];
+  for (int b = 0; b < NUM_ORDER_BLOCKS; ++b) {
+    int score = 0;
+    for (int k = b * ORDER_BLOCK; k < (b + 1) * ORDER_BLOCK; ++k) {
+      int d = 2 * tile[k] - 255;
+      score += d * d;
+    }
+    blocks[b] = (OrderBlock){score, b * ORDER_BLOCK};
+  }
+  qsort(blocks, NUM_ORDER_BLOCKS, sizeof(OrderBlock), compare_blocks);
+  for (int b = 0; b < NUM_ORDER_BLOCKS; ++b) {
+    offsets[b] = blocks[b].offset;
+  }
+}
+
+void ordered_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset,
+                   SSDKernel ssd, int *indices) {
+  long long num_full = 0, num_touched = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+ : num_full, num_touched)
+  for (int t = 0; t < num_tiles; ++t) {
+    const unsigned char *tile = tiles + (size_t)t * TILE_LEN;
+    int offsets[NUM_ORDER_BLOCKS];
+    order_blocks(tile, offsets);
+    int sums[C] = {0, 0, 0};
+    for (int k = 0; k < TILE_LEN; ++k) {
+      sums[k / (H * W)] += tile[k];
+    }
+
+    int min_dist = INT_MAX, min_i = 0;
+    for (int i = 0; i < dataset->count; ++i) {
+      if (mean_bound(sums, dataset->sums + i * C) >= min_dist) continue;
+      const unsigned char *data = dataset->tiles + (size_t)i * TILE_LEN;
+      int d = 0, b = 0;
+      while (b < NUM_ORDER_BLOCKS && d < min_dist) {
+        d += ssd(tile + offsets[b], data + offsets[b], ORDER_BLOCK, INT_MAX);
+        b++;
+      }
+      num_full++;
+      num_touched += b;
+      if (d < min_dist) {
+        min_dist = d;
+        min_i = i;
+      }
+    }
+    indices[t] = min_i;
+  }
+
+  log_debug("[photomosaic] Ordered SSD touched %.1f%% of the pixels of %lld candidates",
+            num_full > 0 ? 100.0 * num_touched / ((double)num_full * NUM_ORDER_BLOCKS) : 0.0,
+            num_full);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <dataset.h>
+#include "ssd.h"
+
+/**
+ * Exact linear scan whose distance visits the pixel blocks of each tile from the most extreme
+ * to the least, so that a bad candidate crosses the best distance so far after fewer pixels
+ * @param tiles CHW tiles of length TILE_LEN each
+ * @param indices output dataset index for each tile
+ */
+void ordered_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset,
+                   SSDKernel ssd, int *indices);
@@ -0,0 +1,92 @@
+#include "pca.h"
+#include <limits.h>
+#include <log/log.h>
+#include <math.h>
+#include <omp.h>
+#include <stdlib.h>
+#include "topk.h"
+
+#define W 32
+#define H 32
+#define C 3
+#define TILE_LEN (H * W * C)
+
+// Slack for the float rounding of the stored basis and coordinates, in L2 units and relative
+#define PCA_ABS_SLACK 0.1
+#define PCA_REL_SLACK 1e-4
+
+/**
+ * Projected squared distance between two coordinate vectors
+ */
+static inline float projected_dist(const float *a, const float *b, int dims) {
+  float sum = 0;
+  for (int c = 0; c < dims; ++c) {
+    float d = a[c] - b[c];
+    sum += d * d;
+  }
+  return sum;
+}
+
+/**
+ * Lower bound on the full SSD given the projected distance, loosened by the rounding slack
+ */
+static inline double pca_bound(float projected) {
+  double r = sqrt(projected) - PCA_ABS_SLACK;
+  return r > 0 ? r * r * (1 - PCA_REL_SLACK) : 0;
+}
+
+void pca_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset, SSDKernel ssd,
+               int *indices) {
+  size_t basis_size;
+  const float *mean = dataset_section(dataset, SECTION_PCA_MEAN, NULL);
+  const float *basis = dataset_section(dataset, SECTION_PCA_BASIS, &basis_size);
+  const float *coords = dataset_section(dataset, SECTION_PCA_COORDS, NULL);
+  if (mean == NULL || basis == NULL || coords == NULL) {
+    log_error("The dataset has no PCA coordinates; rebuild it with build_index -c <dims>");
+    exit(EXIT_FAILURE);
+  }
+  int dims = basis_size / (TILE_LEN * sizeof(float));
+  log_debug("[photomosaic] PCA bound with %d components", dims);
+
+  long long num_dist = 0;
+#pragma omp parallel reduction(+ : num_dist)
+  {
+    float *projected = (float *)malloc(dataset->count * sizeof(float));
+    float *y = (float *)malloc(dims * sizeof(float));
+
+#pragma omp for schedule(dynamic)
+    for (int t = 0; t < num_tiles; ++t) {
+      const unsigned char *tile = tiles + (size_t)t * TILE_LEN;
+      pca_project(tile, TILE_LEN, mean, basis, dims, y);
+
+      // Seed the search with the candidate nearest in PCA space so the bound bites early
+      int seed = 0;
+      for (int i = 0; i < dataset->count; ++i) {
+        projected[i] = projected_dist(y, coords + (size_t)i * dims, dims);
+        if (projected[i] < projected[seed]) seed = i;
+      }
+      int min_dist = ssd(tile, dataset->tiles + (size_t)seed * TILE_LEN, TILE_LEN, INT_MAX);
+      int min_i = seed;
+      num_dist++;
+
+      for (int i = 0; i < dataset->count; ++i) {
+        if (i == seed) continue;
+        double lb = pca_bound(projected[i]);
+        if (lb > min_dist || (lb >= min_dist && i > min_i)) continue;
+        int d = ssd(tile, dataset->tiles + (size_t)i * TILE_LEN, TILE_LEN, min_dist + 1);
+        if (beats(d, i, min_dist, min_i)) {
+          min_dist = d;
+          min_i = i;
+        }
+        num_dist++;
+      }
+      indices[t] = min_i;
+    }
+
+    free(projected);
+    free(y);
+  }
+
+  log_debug("[photomosaic] PCA computed %.1f full distances per tile on average",
+            num_tiles > 0 ? (double)num_dist / num_tiles : 0.0);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <dataset.h>
+#include "ssd.h"
+
+/**
+ * Coordinates of a tile in the PCA basis stored in the index. The builder and the search share
+ * this routine so that both sides round the same way.
+ * @param basis dims rows of dim floats
+ * @param coords output buffer of dims floats
+ */
+static inline void pca_project(const unsigned char *tile, int dim, const float *mean,
+                               const float *basis, int dims, float *coords) {
+  for (int c = 0; c < dims; ++c) {
+    const float *row = basis + (size_t)c * dim;
+    double sum = 0;
+    for (int k = 0; k < dim; ++k) {
+      sum += (tile[k] - mean[k]) * (double)row[k];
+    }
+    coords[c] = sum;
+  }
+}
+
+/**
+ * Exact search that discards candidates whose PCA-projected distance, a lower bound on the full
+ * SSD, already exceeds the best distance so far
+ * @param tiles CHW tiles of length TILE_LEN each
+ * @param indices output dataset index for each tile
+ */
+void pca_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset, SSDKernel ssd,
+               int *indices);
@@ -1,15 +1,42 @@
 #include "photomosaic.h"
 #include <limits.h>
 #include <log/log.h>
+#include <math.h>
 #include <omp.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bounds.h"
+#include "gemm.h"
+#include "ivf.h"
+#include "kdtree.h"
+#include "options.h"
+#include "ordered.h"
+#include "pca.h"
+#include "pq.h"
+#include "pyramid.h"
+#include "soa.h"
+#include "ssd.h"
+#include "stream.h"
+#include "topk.h"
 #include "util.h"
+#include "vptree.h"
 
-#define CIFAR10_SIZE 60000
 #define W 32
 #define H 32
 #define C 3
 #define TILE_LEN (H * W * C)
 #define MAX_DIST (TILE_LEN * 255 * 255)
+#define DATA_BLOCK 64  // 192KB of dataset images, sized to stay in L2
+#define TILE_GROUP 16  // Tiles compared against each dataset block while it is hot
+#define KD_SEEDS 8     // Nearest images in mean colour evaluated before the scan
+
+/**
+ * Per-tile statistics used to bound the distance before running dist()
+ */
+typedef struct {
+  double norm;      // L2 norm of the tile
+  int sums[C];      // Pixel sum of each channel
+} TileStats;
 
 /**
  * Fetch image data of size 32x32 from HWC format to CHW format
@@ -27,44 +54,237 @@ inline void fetch_chw(unsigned char *dest, const unsigned char *src, int width)
   }
 }
 
+/**
+ * Compute norm and channel sums of a CHW tile
+ */
+inline void tile_stats(TileStats *stats, const unsigned char *tile) {
+  int sq = 0;
+  for (int c = 0; c < C; c++) {
+    int sum = 0;
+    for (int i = 0; i < H * W; i++) {
+      int v = tile[c * H * W + i];
+      sum += v;
+      sq += v * v;
+    }
+    stats->sums[c] = sum;
+  }
+  stats->norm = sqrt((double)sq);
+}
+
+/**
+ * Lower bound of dist() between two tiles from their statistics. Uses the larger of the
+ * channel mean bound (Cauchy-Schwarz on each channel) and the reverse triangle inequality
+ * (|a| - |b|)^2. The result never exceeds the exact distance.
+ */
+static inline int dist_lower_bound(const TileStats *a, const TileStats *b) {
+  int channel_bound = mean_bound(a->sums, b->sums);
+
+  // Norms are irrational; back off by one so rounding can never overshoot the exact distance
+  double norm_diff = a->norm - b->norm;
+  double norm_bound = norm_diff * norm_diff - 1.0;
+  if (norm_bound > channel_bound) return norm_bound > MAX_DIST ? MAX_DIST : (int)norm_bound;
+  return channel_bound;
+}
+
+static SSDKernel ssd;
+
 /**
  * Compute L2 distance between buffer a and buffer b for length TILE_LEN
  * @param threshold Computation breaks if error goes above threshold
  */
-inline int dist(const unsigned char *a, const unsigned char *b, int threshold) {
-  int sum = 0;
-  for (int i = 0; i < TILE_LEN; i++) {
-    int diff = (int)a[i] - (int)b[i];
-    sum += diff * diff;
+static inline int dist(const unsigned char *a, const unsigned char *b, int threshold) {
+  return ssd(a, b, TILE_LEN, threshold);
+}
+
+/**
+ * Scan the whole dataset for each tile, skipping candidates whose lower bound cannot beat the
+ * current best. Each thread takes a group of tiles and streams the dataset past them one
+ * L2-sized block at a time, so the dataset is read once per group instead of once per tile.
+ * Before the scan every tile is compared with its nearest images in mean colour, found with a
+ * k-d tree, so that pruning starts from a near-optimal bound instead of MAX_DIST.
+ */
+static void search_linear(const unsigned char *tiles, int num_tiles, const Dataset *dataset,
+                          const TileStats *stats, const KDTree *colours, int *indices) {
+  int num_data = dataset->count;
+  int group = (num_tiles + omp_get_max_threads() - 1) / omp_get_max_threads();
+  if (group > TILE_GROUP) group = TILE_GROUP;
+  if (group < 1) group = 1;
+
+  long long num_full = 0;
+  int num_seeded = 0;
+#pragma omp parallel for shared(indices) schedule(dynamic) reduction(+ : num_full, num_seeded)
+  for (int t0 = 0; t0 < num_tiles; t0 += group) {
+    int t1 = t0 + group < num_tiles ? t0 + group : num_tiles;
+    TileStats tile_stat[TILE_GROUP];
+    int min_dist[TILE_GROUP];
+    int min_i[TILE_GROUP];
+    int seed_i[TILE_GROUP];
+    for (int t = t0; t < t1; ++t) {
+      const unsigned char *tile = tiles + t * TILE_LEN;
+      int k = t - t0;
+      tile_stats(&tile_stat[k], tile);
+      min_dist[k] = MAX_DIST + 1;
+      min_i[k] = 0;
+      int seeds[KD_SEEDS];
+      int num_seeds = kdtree_nearest(colours, tile_stat[k].sums, KD_SEEDS, seeds);
+      for (int s = 0; s < num_seeds; ++s) {
+        int d = dist(tile, dataset->tiles + ((size_t)seeds[s] * TILE_LEN), min_dist[k] + 1);
+        if (beats(d, seeds[s], min_dist[k], min_i[k])) {
+          min_dist[k] = d;
+          min_i[k] = seeds[s];
+        }
+      }
+      num_full += num_seeds;
+      seed_i[k] = min_i[k];
+    }
+
+    for (int b0 = 0; b0 < num_data; b0 += DATA_BLOCK) {
+      int b1 = b0 + DATA_BLOCK < num_data ? b0 + DATA_BLOCK : num_data;
+      for (int t = t0; t < t1; ++t) {
+        const unsigned char *tile = tiles + t * TILE_LEN;
+        int k = t - t0;
+        for (int i = b0; i < b1; ++i) {
+          // The seed may have a higher index than an equally distant image, so ties go through
+          int lb = dist_lower_bound(&tile_stat[k], &stats[i]);
+          if (lb > min_dist[k] || (lb == min_dist[k] && i >= min_i[k])) continue;
+          num_full++;
+          int d = dist(tile, dataset->tiles + ((size_t)i * TILE_LEN), min_dist[k] + 1);
+          if (beats(d, i, min_dist[k], min_i[k])) {
+            min_dist[k] = d;
+            min_i[k] = i;
+          }
+        }
+      }
+    }
+
+    for (int t = t0; t < t1; ++t) {
+      indices[t] = min_i[t - t0];
+      num_seeded += min_i[t - t0] == seed_i[t - t0];
+    }
+  }
+
+  long long num_pairs = (long long)num_tiles * num_data;
+  log_debug("[photomosaic] %lld of %lld candidates reached dist()", num_full, num_pairs);
+  log_debug("[photomosaic] Colour seed was the final match for %d of %d tiles", num_seeded,
+            num_tiles);
+}
+
+/**
+ * Statistics of every dataset image, for dist_lower_bound()
+ */
+static TileStats *dataset_stats(const Dataset *dataset) {
+  TileStats *stats = (TileStats *)malloc(dataset->count * sizeof(TileStats));
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < dataset->count; ++i) {
+    stats[i].norm = sqrt((double)dataset->sq_norms[i]);
+    for (int c = 0; c < C; ++c) {
+      stats[i].sums[c] = dataset->sums[i * C + c];
+    }
   }
-  return sum;
+  return stats;
 }
 
-void photomosaic(unsigned char *img, int width, int height, const unsigned char *dataset,
-                 int *indices) {
-  unsigned char img_local[TILE_LEN];
-  omp_set_num_threads(32);
+struct Photomosaic {
+  const Dataset *dataset;
+  int num_threads;  // Applied on every run, since the thread count is per calling thread
+
+  // Built once for the selected search engine, NULL if it does not use them
+  TileStats *stats;
+  KDTree *colours;
+  int *coarse_data;
+  const unsigned char *soa;  // A section of the dataset or soa_converted
+  void *soa_converted;
+  GemmPanels *panels;
+};
+
+Photomosaic *photomosaic_create(const Dataset *dataset) {
+  int num_threads = options.threads > 0 ? options.threads : 32;
+  omp_set_num_threads(num_threads);
 
   log_info("=================================");
   log_info("Photomosaic OpenMP implementation");
   log_info("=================================");
-  log_info("OpenMP uses %d threads", omp_get_max_threads());
+  log_info("OpenMP uses %d threads", num_threads);
+  log_info("Search engine: %s", options.search);
 
-#pragma omp parallel for collapse(2) private(img_local) shared(indices) schedule(guided)
+  const char *ssd_name;
+  ssd = ssd_select(&ssd_name);
+  log_info("SSD kernel: %s", ssd_name);
+
+  Photomosaic *mosaic = (Photomosaic *)calloc(1, sizeof(Photomosaic));
+  mosaic->dataset = dataset;
+  mosaic->num_threads = num_threads;
+  if (dataset->tiles == NULL) return mosaic;  // Streamed, photomosaic_run() ignores the engine
+  timer_start();
+  if (strcmp(options.search, "linear") == 0) {
+    mosaic->stats = dataset_stats(dataset);
+    mosaic->colours = kdtree_build(dataset->sums, dataset->count, C);
+  } else if (strcmp(options.search, "soa") == 0) {
+    mosaic->soa = soa_tiles(dataset, &mosaic->soa_converted);
+  } else if (strcmp(options.search, "pyramid") == 0) {
+    mosaic->coarse_data = pyramid_coarsen(dataset);
+  } else if (strcmp(options.search, "gemm") == 0) {
+    mosaic->panels = gemm_pack(dataset->tiles, dataset->count);
+  }
+  timer_stop_and_log("[photomosaic] search engine setup time");
+  return mosaic;
+}
+
+void photomosaic_run(Photomosaic *mosaic, unsigned char *img, int width, int height,
+                     int *indices) {
+  // Server workers are not the thread that created the mosaic
+  omp_set_num_threads(mosaic->num_threads);
+  const Dataset *dataset = mosaic->dataset;
+  int num_tiles = (width / W) * (height / H);
+  unsigned char *tiles = (unsigned char *)malloc(num_tiles * TILE_LEN);
+#pragma omp parallel for collapse(2) schedule(static)
   for (int tile_h = 0; tile_h < height; tile_h += H) {
     for (int tile_w = 0; tile_w < width; tile_w += W) {
-      fetch_chw(img_local, img + (tile_h * width + tile_w) * C, width);
-      int min_dist = MAX_DIST;
-      int min_i = 0;
-      for (int i = 0; i < CIFAR10_SIZE; ++i) {
-        int d = dist(img_local, dataset + (i * TILE_LEN), min_dist);
-        if (d < min_dist) {
-          min_dist = d;
-          min_i = i;
-        }
-      }
       int tile_i = (tile_h / H) * (width / W) + (tile_w / W);
-      indices[tile_i] = min_i;
+      fetch_chw(tiles + tile_i * TILE_LEN, img + (tile_h * width + tile_w) * C, width);
     }
   }
+
+  if (dataset->tiles == NULL) {
+    log_info("Streaming the dataset; the %s search engine is not used", options.search);
+    stream_match(tiles, num_tiles, dataset, ssd, options.stream_chunk, indices);
+  } else if (strcmp(options.search, "linear") == 0) {
+    search_linear(tiles, num_tiles, dataset, mosaic->stats, mosaic->colours, indices);
+  } else if (strcmp(options.search, "ordered") == 0) {
+    ordered_match(tiles, num_tiles, dataset, ssd, indices);
+  } else if (strcmp(options.search, "soa") == 0) {
+    soa_match(tiles, num_tiles, dataset, mosaic->soa, indices);
+  } else if (strcmp(options.search, "pyramid") == 0) {
+    pyramid_match(tiles, num_tiles, dataset, mosaic->coarse_data, ssd, options.topk, indices);
+  } else if (strcmp(options.search, "ivf") == 0) {
+    ivf_match(tiles, num_tiles, dataset, ssd, options.nprobe, indices);
+  } else if (strcmp(options.search, "vptree") == 0) {
+    vptree_match(tiles, num_tiles, dataset, ssd, indices);
+  } else if (strcmp(options.search, "pca") == 0) {
+    pca_match(tiles, num_tiles, dataset, ssd, indices);
+  } else if (strcmp(options.search, "pq") == 0) {
+    pq_match(tiles, num_tiles, dataset, ssd, options.topk, indices);
+  } else if (strcmp(options.search, "gemm") == 0) {
+    gemm_match(tiles, num_tiles, mosaic->panels, indices);
+  } else {
+    log_error("Unknown search engine: %s", options.search);
+    exit(EXIT_FAILURE);
+  }
+  free(tiles);
+}
+
+void photomosaic_destroy(Photomosaic *mosaic) {
+  free(mosaic->stats);
+  if (mosaic->colours) kdtree_free(mosaic->colours);
+  free(mosaic->coarse_data);
+  free(mosaic->soa_converted);
+  if (mosaic->panels) gemm_free(mosaic->panels);
+  free(mosaic);
+}
+
+void photomosaic(unsigned char *img, int width, int height, const Dataset *dataset,
+                 int *indices) {
+  Photomosaic *mosaic = photomosaic_create(dataset);
+  photomosaic_run(mosaic, img, width, height, indices);
+  photomosaic_destroy(mosaic);
 }
@@ -0,0 +1,74 @@
+#include "pq.h"
+#include <limits.h>
+#include <log/log.h>
+#include <omp.h>
+#include <stdlib.h>
+#include "topk.h"
+
+#define W 32
+#define H 32
+#define C 3
+#define TILE_LEN (H * W * C)
+#define PQ_CENTROIDS 256
+#define PQ_DEFAULT_TOPK 32
+
+void pq_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset, SSDKernel ssd,
+              int topk, int *indices) {
+  size_t codes_size;
+  const unsigned char *codebooks = dataset_section(dataset, SECTION_PQ_CODEBOOKS, NULL);
+  const unsigned char *codes = dataset_section(dataset, SECTION_PQ_CODES, &codes_size);
+  if (codebooks == NULL || codes == NULL) {
+    log_error("The dataset has no PQ codes; rebuild it with build_index -p <subquantizers>");
+    exit(EXIT_FAILURE);
+  }
+  // One code byte per subquantizer and image; each codebook holds PQ_CENTROIDS subvectors
+  int m = codes_size / dataset->count;
+  int dsub = TILE_LEN / m;
+  if (topk < 1) topk = PQ_DEFAULT_TOPK;
+  log_debug("[photomosaic] PQ with %d subquantizers of %d bytes, reranking %d", m, dsub, topk);
+
+#pragma omp parallel
+  {
+    int *lut = (int *)malloc(m * PQ_CENTROIDS * sizeof(int));
+    int *ds = (int *)malloc(topk * sizeof(int));
+    int *ids = (int *)malloc(topk * sizeof(int));
+
+#pragma omp for schedule(dynamic)
+    for (int t = 0; t < num_tiles; ++t) {
+      const unsigned char *tile = tiles + (size_t)t * TILE_LEN;
+      for (int s = 0; s < m; ++s) {
+        for (int k = 0; k < PQ_CENTROIDS; ++k) {
+          lut[s * PQ_CENTROIDS + k] = ssd(tile + s * dsub,
+                                          codebooks + ((size_t)s * PQ_CENTROIDS + k) * dsub, dsub,
+                                          INT_MAX);
+        }
+      }
+
+      // Asymmetric distance: exact query against quantized images
+      int size = 0;
+      for (int i = 0; i < dataset->count; ++i) {
+        const unsigned char *code = codes + (size_t)i * m;
+        int d = 0;
+        for (int s = 0; s < m; ++s) {
+          d += lut[s * PQ_CENTROIDS + code[s]];
+        }
+        topk_push(ds, ids, &size, topk, d, i);
+      }
+
+      int min_dist = INT_MAX, min_i = 0;
+      for (int k = 0; k < size; ++k) {
+        int threshold = min_dist == INT_MAX ? INT_MAX : min_dist + 1;
+        int d = ssd(tile, dataset->tiles + (size_t)ids[k] * TILE_LEN, TILE_LEN, threshold);
+        if (beats(d, ids[k], min_dist, min_i)) {
+          min_dist = d;
+          min_i = ids[k];
+        }
+      }
+      indices[t] = min_i;
+    }
+
+    free(lut);
+    free(ds);
+    free(ids);
+  }
+}
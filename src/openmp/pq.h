@@ -0,0 +1,14 @@
+#pragma once
+
+#include <dataset.h>
+#include "ssd.h"
+
+/**
+ * Approximate search over the product-quantized codes of the index. Each tile builds one lookup
+ * table of subvector distances per subquantizer, scores every image from its codes alone, and
+ * reranks the topk best scores with the exact distance on the original tiles.
+ * @param tiles CHW tiles of length TILE_LEN each
+ * @param indices output dataset index for each tile
+ */
+void pq_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset, SSDKernel ssd,
+              int topk, int *indices);
@@ -0,0 +1,203 @@
+#include "pyramid.h"
+#include <limits.h>
+#include <log/log.h>
+#include <omp.h>
+#include <stdlib.h>
+#include "bounds.h"
+#include "topk.h"
+
+#define W 32
+#define H 32
+#define C 3
+#define TILE_LEN (H * W * C)
+#define MAX_DIST (TILE_LEN * 255 * 255)
+
+// Level 1 thumbnails are 4x4 per channel, made of 2x2 texels of the stored 8x8 thumbnails
+#define COARSE_W (THUMB_W / 2)
+#define COARSE_H (THUMB_H / 2)
+#define COARSE_LEN (COARSE_W * COARSE_H * C)
+#define THUMB_BLOCK ((H / THUMB_H) * (W / THUMB_W))
+#define COARSE_BLOCK (THUMB_BLOCK * 4)
+
+/**
+ * Sum 8x8 texels of block sums down to 4x4
+ */
+static void coarsen(int *coarse, const unsigned short *thumb) {
+  for (int c = 0; c < C; ++c) {
+    for (int h = 0; h < COARSE_H; ++h) {
+      for (int w = 0; w < COARSE_W; ++w) {
+        const unsigned short *t = thumb + (c * THUMB_H + h * 2) * THUMB_W + w * 2;
+        coarse[(c * COARSE_H + h) * COARSE_W + w] = t[0] + t[1] + t[THUMB_W] + t[THUMB_W + 1];
+      }
+    }
+  }
+}
+
+static void tile_thumb(unsigned short *thumb, const unsigned char *tile) {
+  int bh = H / THUMB_H, bw = W / THUMB_W;
+  for (int k = 0; k < THUMB_LEN; ++k) {
+    thumb[k] = 0;
+  }
+  for (int c = 0; c < C; ++c) {
+    for (int h = 0; h < H; ++h) {
+      for (int w = 0; w < W; ++w) {
+        thumb[(c * THUMB_H + h / bh) * THUMB_W + w / bw] += tile[(c * H + h) * W + w];
+      }
+    }
+  }
+}
+
+/**
+ * Lower bounds of the SSD from block sums, like mean_bound() on finer blocks. The pyramid goes
+ * from channel sums (1x1) through the 4x4 and 8x8 thumbnails to the full tile, each level
+ * bounding the next one from below.
+ */
+static inline int coarse_bound(const int *a, const int *b) {
+  long long sum = 0;
+  for (int k = 0; k < COARSE_LEN; ++k) {
+    long long d = a[k] - b[k];
+    sum += d * d;
+  }
+  return (int)(sum / COARSE_BLOCK);
+}
+
+static inline int thumb_bound(const unsigned short *a, const unsigned short *b) {
+  unsigned sum = 0;
+  for (int k = 0; k < THUMB_LEN; ++k) {
+    int d = (int)a[k] - (int)b[k];
+    sum += d * d;
+  }
+  return (int)(sum / THUMB_BLOCK);
+}
+
+/**
+ * Every level of one input tile
+ */
+typedef struct {
+  int sums[C];
+  int coarse[COARSE_LEN];
+  unsigned short thumb[THUMB_LEN];
+} Pyramid;
+
+static void build_pyramid(Pyramid *p, const unsigned char *tile) {
+  tile_thumb(p->thumb, tile);
+  coarsen(p->coarse, p->thumb);
+  for (int c = 0; c < C; ++c) {
+    p->sums[c] = 0;
+    for (int k = 0; k < THUMB_H * THUMB_W; ++k) {
+      p->sums[c] += p->thumb[c * THUMB_H * THUMB_W + k];
+    }
+  }
+}
+
+/**
+ * Find the candidate with the smallest 8x8 bound, using the 4x4 bound to skip most of them
+ */
+static int coarse_winner(const Pyramid *p, const Dataset *dataset, const int *coarse_data) {
+  int best_lb = INT_MAX, best_i = 0;
+  for (int i = 0; i < dataset->count; ++i) {
+    if (mean_bound(p->sums, dataset->sums + i * C) >= best_lb) continue;
+    if (coarse_bound(p->coarse, coarse_data + i * COARSE_LEN) >= best_lb) continue;
+    int lb = thumb_bound(p->thumb, dataset->thumbs + (size_t)i * THUMB_LEN);
+    if (lb < best_lb) {
+      best_lb = lb;
+      best_i = i;
+    }
+  }
+  return best_i;
+}
+
+static int search_exact(const unsigned char *tile, const Pyramid *p, const Dataset *dataset,
+                        const int *coarse_data, SSDKernel ssd, int seed) {
+  int min_i = seed;
+  int min_dist = ssd(tile, dataset->tiles + (size_t)seed * TILE_LEN, TILE_LEN, INT_MAX);
+  for (int i = 0; i < dataset->count; ++i) {
+    if (i == seed) continue;
+    if (!beats(mean_bound(p->sums, dataset->sums + i * C), i, min_dist, min_i)) continue;
+    if (!beats(coarse_bound(p->coarse, coarse_data + i * COARSE_LEN), i, min_dist, min_i)) continue;
+    if (!beats(thumb_bound(p->thumb, dataset->thumbs + (size_t)i * THUMB_LEN), i, min_dist, min_i))
+      continue;
+    // Abandoning only above min_dist keeps equal distances exact for the index tie-break
+    int d = ssd(tile, dataset->tiles + (size_t)i * TILE_LEN, TILE_LEN, min_dist + 1);
+    if (beats(d, i, min_dist, min_i)) {
+      min_dist = d;
+      min_i = i;
+    }
+  }
+  return min_i;
+}
+
+static int search_topk(const unsigned char *tile, const Pyramid *p, const Dataset *dataset,
+                       const int *coarse_data, SSDKernel ssd, int topk, int *lbs, int *ids,
+                       int *seed) {
+  int size = 0;
+  for (int i = 0; i < dataset->count; ++i) {
+    if (size == topk) {
+      if (mean_bound(p->sums, dataset->sums + i * C) > lbs[0]) continue;
+      if (coarse_bound(p->coarse, coarse_data + i * COARSE_LEN) > lbs[0]) continue;
+    }
+    int lb = thumb_bound(p->thumb, dataset->thumbs + (size_t)i * THUMB_LEN);
+    topk_push(lbs, ids, &size, topk, lb, i);
+  }
+
+  int seed_lb = lbs[0];
+  *seed = ids[0];
+  for (int k = 1; k < size; ++k) {
+    if (beats(lbs[k], ids[k], seed_lb, *seed)) {
+      seed_lb = lbs[k];
+      *seed = ids[k];
+    }
+  }
+
+  int min_dist = INT_MAX, min_i = 0;
+  for (int k = 0; k < size; ++k) {
+    int d = ssd(tile, dataset->tiles + (size_t)ids[k] * TILE_LEN, TILE_LEN,
+                min_dist == INT_MAX ? INT_MAX : min_dist + 1);
+    if (beats(d, ids[k], min_dist, min_i)) {
+      min_dist = d;
+      min_i = ids[k];
+    }
+  }
+  return min_i;
+}
+
+int *pyramid_coarsen(const Dataset *dataset) {
+  int *coarse_data = (int *)malloc((size_t)dataset->count * COARSE_LEN * sizeof(int));
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < dataset->count; ++i) {
+    coarsen(coarse_data + i * COARSE_LEN, dataset->thumbs + (size_t)i * THUMB_LEN);
+  }
+  return coarse_data;
+}
+
+void pyramid_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset,
+                   const int *coarse_data, SSDKernel ssd, int topk, int *indices) {
+  int num_changed = 0;
+#pragma omp parallel reduction(+ : num_changed)
+  {
+    int *lbs = (int *)malloc((topk > 0 ? topk : 1) * sizeof(int));
+    int *ids = (int *)malloc((topk > 0 ? topk : 1) * sizeof(int));
+
+#pragma omp for schedule(dynamic)
+    for (int t = 0; t < num_tiles; ++t) {
+      const unsigned char *tile = tiles + (size_t)t * TILE_LEN;
+      Pyramid p;
+      build_pyramid(&p, tile);
+
+      int seed;
+      if (topk > 0) {
+        indices[t] = search_topk(tile, &p, dataset, coarse_data, ssd, topk, lbs, ids, &seed);
+      } else {
+        seed = coarse_winner(&p, dataset, coarse_data);
+        indices[t] = search_exact(tile, &p, dataset, coarse_data, ssd, seed);
+      }
+      if (indices[t] != seed) num_changed++;
+    }
+
+    free(lbs);
+    free(ids);
+  }
+
+  log_debug("[photomosaic] full SSD changed the 8x8 thumbnail winner for %d of %d tiles",
+            num_changed, num_tiles);
+}
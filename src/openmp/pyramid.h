@@ -0,0 +1,23 @@
+#pragma once
+
+#include <dataset.h>
+#include "ssd.h"
+
+/**
+ * 4x4 thumbnails of every dataset image, summed down from the stored 8x8 ones
+ * @return count x 48 block sums, to free()
+ */
+int *pyramid_coarsen(const Dataset *dataset);
+
+/**
+ * Coarse-to-fine search. Candidates are first scored on 4x4 and 8x8 thumbnails, whose block sum
+ * differences give lower bounds of the full distance, and only the survivors are compared with
+ * the full 32x32 SSD.
+ * @param tiles CHW tiles of length TILE_LEN each
+ * @param coarse_data from pyramid_coarsen()
+ * @param topk 0 for an exact search; otherwise only the topk candidates with the smallest 8x8
+ *             bound are reranked, which is approximate
+ * @param indices output dataset index for each tile
+ */
+void pyramid_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset,
+                   const int *coarse_data, SSDKernel ssd, int topk, int *indices);
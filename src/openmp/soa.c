@@ -0,0 +1,252 @@
+#define _POSIX_C_SOURCE 200112L
+#include "soa.h"
+#include <immintrin.h>
+#include <limits.h>
+#include <log/log.h>
+#include <omp.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bounds.h"
+
+#define W 32
+#define H 32
+#define C 3
+#define TILE_LEN (H * W * C)
+#define SOA_ROW (SOA_LANES * 2)
+#define SOA_CHECK 128     // Rows between early-abandon checks, SSD_BLOCK pixels
+#define SOA_PREFETCH 8    // Rows to prefetch ahead of the one being summed
+#define SOA_SKIP (INT_MAX / 2)  // Starting sum of lanes that must not be computed
+#define TILE_GROUP 16
+
+/**
+ * Add the SSD between tile and every candidate of an interleaved block to dists, stopping at a
+ * check point once every lane has reached threshold
+ * @param dists per-lane starting sums on input; lanes starting at or above threshold never hold
+ *              back the early abandon
+ */
+typedef void (*SoAKernel)(const unsigned char *tile, const unsigned char *block, int len,
+                          int threshold, int *dists);
+
+static void soa_scalar(const unsigned char *tile, const unsigned char *block, int len,
+                       int threshold, int *dists) {
+  for (int p0 = 0; p0 < len / 2; p0 += SOA_CHECK) {
+    int p1 = p0 + SOA_CHECK < len / 2 ? p0 + SOA_CHECK : len / 2;
+    for (int p = p0; p < p1; ++p) {
+      const unsigned char *row = block + (size_t)p * SOA_ROW;
+      for (int l = 0; l < SOA_LANES; ++l) {
+        int d0 = row[2 * l] - tile[2 * p];
+        int d1 = row[2 * l + 1] - tile[2 * p + 1];
+        dists[l] += d0 * d0 + d1 * d1;
+      }
+    }
+    int done = 1;
+    for (int l = 0; l < SOA_LANES; ++l) {
+      done &= dists[l] >= threshold;
+    }
+    if (done) return;
+  }
+}
+
+/**
+ * madd of the zero-extended low (high) bytes of each 128-bit chunk yields the sums of lanes
+ * 8c..8c+3 (8c+4..8c+7) of chunk c; scatter them back in lane order
+ */
+static inline void soa_unscramble(const int *lo, const int *hi, int chunks, int *dists) {
+  for (int c = 0; c < chunks; ++c) {
+    for (int e = 0; e < 4; ++e) {
+      dists[c * 8 + e] = lo[c * 4 + e];
+      dists[c * 8 + 4 + e] = hi[c * 4 + e];
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static void soa_avx2(const unsigned char *tile,
+                                                     const unsigned char *block, int len,
+                                                     int threshold, int *dists) {
+  int lo[16], hi[16];
+  for (int c = 0; c < 4; ++c) {
+    for (int e = 0; e < 4; ++e) {
+      lo[c * 4 + e] = dists[c * 8 + e];
+      hi[c * 4 + e] = dists[c * 8 + 4 + e];
+    }
+  }
+  __m256i acc_lo0 = _mm256_loadu_si256((const __m256i *)lo);
+  __m256i acc_lo1 = _mm256_loadu_si256((const __m256i *)(lo + 8));
+  __m256i acc_hi0 = _mm256_loadu_si256((const __m256i *)hi);
+  __m256i acc_hi1 = _mm256_loadu_si256((const __m256i *)(hi + 8));
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i limit = _mm256_set1_epi32(threshold);
+  const unsigned short *pairs = (const unsigned short *)tile;
+  for (int p0 = 0; p0 < len / 2; p0 += SOA_CHECK) {
+    int p1 = p0 + SOA_CHECK < len / 2 ? p0 + SOA_CHECK : len / 2;
+    for (int p = p0; p < p1; ++p) {
+      const unsigned char *row = block + (size_t)p * SOA_ROW;
+      _mm_prefetch((const char *)(row + SOA_PREFETCH * SOA_ROW), _MM_HINT_T0);
+      __m256i q = _mm256_set1_epi16(pairs[p]);
+      __m256i v0 = _mm256_load_si256((const __m256i *)row);
+      __m256i v1 = _mm256_load_si256((const __m256i *)(row + 32));
+      __m256i d0 = _mm256_or_si256(_mm256_subs_epu8(v0, q), _mm256_subs_epu8(q, v0));
+      __m256i d1 = _mm256_or_si256(_mm256_subs_epu8(v1, q), _mm256_subs_epu8(q, v1));
+      __m256i l0 = _mm256_unpacklo_epi8(d0, zero), h0 = _mm256_unpackhi_epi8(d0, zero);
+      __m256i l1 = _mm256_unpacklo_epi8(d1, zero), h1 = _mm256_unpackhi_epi8(d1, zero);
+      acc_lo0 = _mm256_add_epi32(acc_lo0, _mm256_madd_epi16(l0, l0));
+      acc_hi0 = _mm256_add_epi32(acc_hi0, _mm256_madd_epi16(h0, h0));
+      acc_lo1 = _mm256_add_epi32(acc_lo1, _mm256_madd_epi16(l1, l1));
+      acc_hi1 = _mm256_add_epi32(acc_hi1, _mm256_madd_epi16(h1, h1));
+    }
+    __m256i below = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpgt_epi32(limit, acc_lo0), _mm256_cmpgt_epi32(limit, acc_lo1)),
+        _mm256_or_si256(_mm256_cmpgt_epi32(limit, acc_hi0), _mm256_cmpgt_epi32(limit, acc_hi1)));
+    if (_mm256_testz_si256(below, below)) break;
+  }
+  _mm256_storeu_si256((__m256i *)lo, acc_lo0);
+  _mm256_storeu_si256((__m256i *)(lo + 8), acc_lo1);
+  _mm256_storeu_si256((__m256i *)hi, acc_hi0);
+  _mm256_storeu_si256((__m256i *)(hi + 8), acc_hi1);
+  soa_unscramble(lo, hi, 4, dists);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void soa_avx512bw(const unsigned char *tile,
+                                                                     const unsigned char *block,
+                                                                     int len, int threshold,
+                                                                     int *dists) {
+  int lo[16], hi[16];
+  for (int c = 0; c < 4; ++c) {
+    for (int e = 0; e < 4; ++e) {
+      lo[c * 4 + e] = dists[c * 8 + e];
+      hi[c * 4 + e] = dists[c * 8 + 4 + e];
+    }
+  }
+  __m512i acc_lo = _mm512_loadu_si512((const void *)lo);
+  __m512i acc_hi = _mm512_loadu_si512((const void *)hi);
+  const __m512i zero = _mm512_setzero_si512();
+  const __m512i limit = _mm512_set1_epi32(threshold);
+  const unsigned short *pairs = (const unsigned short *)tile;
+  for (int p0 = 0; p0 < len / 2; p0 += SOA_CHECK) {
+    int p1 = p0 + SOA_CHECK < len / 2 ? p0 + SOA_CHECK : len / 2;
+    for (int p = p0; p < p1; ++p) {
+      const unsigned char *row = block + (size_t)p * SOA_ROW;
+      _mm_prefetch((const char *)(row + SOA_PREFETCH * SOA_ROW), _MM_HINT_T0);
+      __m512i q = _mm512_set1_epi16(pairs[p]);
+      __m512i v = _mm512_load_si512((const void *)row);
+      __m512i d = _mm512_or_si512(_mm512_subs_epu8(v, q), _mm512_subs_epu8(q, v));
+      __m512i l = _mm512_unpacklo_epi8(d, zero), h = _mm512_unpackhi_epi8(d, zero);
+      acc_lo = _mm512_add_epi32(acc_lo, _mm512_madd_epi16(l, l));
+      acc_hi = _mm512_add_epi32(acc_hi, _mm512_madd_epi16(h, h));
+    }
+    if (_mm512_cmplt_epi32_mask(acc_lo, limit) == 0 && _mm512_cmplt_epi32_mask(acc_hi, limit) == 0)
+      break;
+  }
+  _mm512_storeu_si512((void *)lo, acc_lo);
+  _mm512_storeu_si512((void *)hi, acc_hi);
+  soa_unscramble(lo, hi, 4, dists);
+}
+
+static SoAKernel soa_select(const char **name) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    *name = "avx512bw";
+    return soa_avx512bw;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    *name = "avx2";
+    return soa_avx2;
+  }
+  *name = "scalar";
+  return soa_scalar;
+}
+
+void soa_interleave(const unsigned char *tiles, int count, int len, unsigned char *out) {
+  int num_blocks = (count + SOA_LANES - 1) / SOA_LANES;
+#pragma omp parallel for schedule(static)
+  for (int b = 0; b < num_blocks; ++b) {
+    unsigned char *block = out + (size_t)b * SOA_LANES * len;
+    memset(block, 0, (size_t)SOA_LANES * len);
+    for (int l = 0; l < SOA_LANES && b * SOA_LANES + l < count; ++l) {
+      const unsigned char *tile = tiles + (size_t)(b * SOA_LANES + l) * len;
+      for (int p = 0; p < len / 2; ++p) {
+        block[(size_t)p * SOA_ROW + 2 * l] = tile[2 * p];
+        block[(size_t)p * SOA_ROW + 2 * l + 1] = tile[2 * p + 1];
+      }
+    }
+  }
+}
+
+const unsigned char *soa_tiles(const Dataset *dataset, void **converted) {
+  *converted = NULL;
+  const unsigned char *soa = dataset_section(dataset, SECTION_SOA_TILES, NULL);
+  if (soa != NULL) return soa;
+  log_warn("The dataset has no interleaved tiles; converting in memory (build_index -l)");
+  if (posix_memalign(converted, 64, soa_size(dataset->count, TILE_LEN)) != 0) {
+    log_error("Failed to allocate the interleaved dataset");
+    exit(EXIT_FAILURE);
+  }
+  soa_interleave(dataset->tiles, dataset->count, TILE_LEN, (unsigned char *)*converted);
+  return (const unsigned char *)*converted;
+}
+
+void soa_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset,
+               const unsigned char *soa, int *indices) {
+  int num_data = dataset->count;
+  int num_blocks = (num_data + SOA_LANES - 1) / SOA_LANES;
+  const char *kernel_name;
+  SoAKernel kernel = soa_select(&kernel_name);
+  log_debug("[photomosaic] SoA kernel: %s", kernel_name);
+
+  int group = (num_tiles + omp_get_max_threads() - 1) / omp_get_max_threads();
+  if (group > TILE_GROUP) group = TILE_GROUP;
+  if (group < 1) group = 1;
+
+  long long num_scanned = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+ : num_scanned)
+  for (int t0 = 0; t0 < num_tiles; t0 += group) {
+    int t1 = t0 + group < num_tiles ? t0 + group : num_tiles;
+    int sums[TILE_GROUP][C];
+    int min_dist[TILE_GROUP], min_i[TILE_GROUP];
+    for (int t = t0; t < t1; ++t) {
+      const unsigned char *tile = tiles + (size_t)t * TILE_LEN;
+      for (int c = 0; c < C; ++c) {
+        sums[t - t0][c] = 0;
+        for (int k = 0; k < H * W; ++k) {
+          sums[t - t0][c] += tile[c * H * W + k];
+        }
+      }
+      min_dist[t - t0] = INT_MAX;
+      min_i[t - t0] = 0;
+    }
+
+    int dists[SOA_LANES];
+    for (int b = 0; b < num_blocks; ++b) {
+      const unsigned char *block = soa + (size_t)b * SOA_LANES * TILE_LEN;
+      for (int t = t0; t < t1; ++t) {
+        int k = t - t0;
+        // Lanes whose mean-colour bound cannot win, and padding lanes, start out saturated
+        unsigned int live = 0;
+        for (int l = 0; l < SOA_LANES; ++l) {
+          int i = b * SOA_LANES + l;
+          dists[l] = SOA_SKIP;
+          if (i < num_data && mean_bound(sums[k], dataset->sums + i * C) < min_dist[k]) {
+            dists[l] = 0;
+            live |= 1u << l;
+          }
+        }
+        if (!live) continue;
+        num_scanned++;
+        kernel(tiles + (size_t)t * TILE_LEN, block, TILE_LEN, min_dist[k], dists);
+        for (int l = 0; l < SOA_LANES; ++l) {
+          if ((live >> l & 1) && dists[l] < min_dist[k]) {
+            min_dist[k] = dists[l];
+            min_i[k] = b * SOA_LANES + l;
+          }
+        }
+      }
+    }
+
+    for (int t = t0; t < t1; ++t) {
+      indices[t] = min_i[t - t0];
+    }
+  }
+
+  log_debug("[photomosaic] SoA scanned %lld of %lld candidate blocks", num_scanned,
+            (long long)num_tiles * num_blocks);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <dataset.h>
+#include <stddef.h>
+
+// Candidates per interleaved block; one 64-byte row holds two pixels of every candidate
+#define SOA_LANES 32
+
+/**
+ * Size in bytes of the interleaved copy of count images of len bytes
+ */
+static inline size_t soa_size(int count, int len) {
+  return (size_t)(count + SOA_LANES - 1) / SOA_LANES * SOA_LANES * len;
+}
+
+/**
+ * Interleave images into blocks of SOA_LANES candidates. Byte j of pixel pair p of candidate
+ * lane l in block b lives at ((b * len / 2 + p) * SOA_LANES + l) * 2 + j, so every 64-byte row
+ * holds the same two pixels of the whole block. Missing lanes of the last block are zero.
+ * @param out buffer of soa_size(count, len) bytes, 64-byte aligned
+ */
+void soa_interleave(const unsigned char *tiles, int count, int len, unsigned char *out);
+
+/**
+ * Interleaved tiles of the dataset: its section from build_index -l, else a copy made here
+ * @param converted set to the copy, to free(), or NULL if the section was used
+ */
+const unsigned char *soa_tiles(const Dataset *dataset, void **converted);
+
+/**
+ * Exact linear scan over the interleaved layout, computing the SSD of SOA_LANES candidates at
+ * once with one accumulator per SIMD lane
+ * @param tiles CHW tiles of length TILE_LEN each
+ * @param soa from soa_tiles()
+ * @param indices output dataset index for each tile
+ */
+void soa_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset,
+               const unsigned char *soa, int *indices);
@@ -0,0 +1,197 @@
+#include "ssd.h"
+#include <immintrin.h>
+#include <log/log.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Each SIMD variant is compiled for its own target so that the rest of the binary keeps the
+ * baseline ISA; ssd_select() picks one at runtime with CPUID.
+ */
+
+static int ssd_scalar(const unsigned char *a, const unsigned char *b, int len, int threshold) {
+  int sum = 0;
+  for (int k = 0; k < len; k += SSD_BLOCK) {
+    int end = k + SSD_BLOCK < len ? k + SSD_BLOCK : len;
+    for (int i = k; i < end; i++) {
+      int diff = (int)a[i] - (int)b[i];
+      sum += diff * diff;
+    }
+    if (sum >= threshold) break;
+  }
+  return sum;
+}
+
+/**
+ * Scalar tail for the bytes that do not fill a whole vector
+ */
+static inline int ssd_tail(const unsigned char *a, const unsigned char *b, int from, int len) {
+  int sum = 0;
+  for (int i = from; i < len; i++) {
+    int diff = (int)a[i] - (int)b[i];
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+__attribute__((target("sse4.1"))) static int ssd_sse41(const unsigned char *a,
+                                                       const unsigned char *b, int len,
+                                                       int threshold) {
+  int sum = 0;
+  int i = 0;
+  const __m128i zero = _mm_setzero_si128();
+  while (i + 16 <= len) {
+    int end = i + SSD_BLOCK <= len ? i + SSD_BLOCK : len & ~15;
+    __m128i acc = _mm_setzero_si128();
+    for (; i < end; i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+      __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+      __m128i lo = _mm_cvtepu8_epi16(d);
+      __m128i hi = _mm_unpackhi_epi8(d, zero);
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum += _mm_cvtsi128_si32(acc);
+    if (sum >= threshold) return sum;
+  }
+  return sum + ssd_tail(a, b, i, len);
+}
+
+__attribute__((target("avx2"))) static int ssd_avx2(const unsigned char *a, const unsigned char *b,
+                                                    int len, int threshold) {
+  int sum = 0;
+  int i = 0;
+  const __m256i zero = _mm256_setzero_si256();
+  while (i + 32 <= len) {
+    int end = i + SSD_BLOCK <= len ? i + SSD_BLOCK : len & ~31;
+    __m256i acc = _mm256_setzero_si256();
+    for (; i < end; i += 32) {
+      __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+      __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+      __m256i d = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+      __m256i lo = _mm256_unpacklo_epi8(d, zero);
+      __m256i hi = _mm256_unpackhi_epi8(d, zero);
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(lo, lo));
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(hi, hi));
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum += _mm_cvtsi128_si32(s);
+    if (sum >= threshold) return sum;
+  }
+  return sum + ssd_tail(a, b, i, len);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static int ssd_avx512bw(const unsigned char *a,
+                                                                    const unsigned char *b,
+                                                                    int len, int threshold) {
+  int sum = 0;
+  int i = 0;
+  const __m512i zero = _mm512_setzero_si512();
+  while (i + 64 <= len) {
+    int end = i + SSD_BLOCK <= len ? i + SSD_BLOCK : len & ~63;
+    __m512i acc = _mm512_setzero_si512();
+    for (; i < end; i += 64) {
+      __m512i va = _mm512_loadu_si512((const void *)(a + i));
+      __m512i vb = _mm512_loadu_si512((const void *)(b + i));
+      __m512i d = _mm512_or_si512(_mm512_subs_epu8(va, vb), _mm512_subs_epu8(vb, va));
+      __m512i lo = _mm512_unpacklo_epi8(d, zero);
+      __m512i hi = _mm512_unpackhi_epi8(d, zero);
+      acc = _mm512_add_epi32(acc, _mm512_madd_epi16(lo, lo));
+      acc = _mm512_add_epi32(acc, _mm512_madd_epi16(hi, hi));
+    }
+    sum += _mm512_reduce_add_epi32(acc);
+    if (sum >= threshold) return sum;
+  }
+  return sum + ssd_tail(a, b, i, len);
+}
+
+/**
+ * VNNI fuses the square and the accumulation of the 16-bit differences with VPDPWSSD
+ */
+__attribute__((target("avx512f,avx512bw,avx512vnni"))) static int ssd_avx512vnni(
+    const unsigned char *a, const unsigned char *b, int len, int threshold) {
+  int sum = 0;
+  int i = 0;
+  const __m512i zero = _mm512_setzero_si512();
+  while (i + 64 <= len) {
+    int end = i + SSD_BLOCK <= len ? i + SSD_BLOCK : len & ~63;
+    __m512i acc = _mm512_setzero_si512();
+    for (; i < end; i += 64) {
+      __m512i va = _mm512_loadu_si512((const void *)(a + i));
+      __m512i vb = _mm512_loadu_si512((const void *)(b + i));
+      __m512i d = _mm512_or_si512(_mm512_subs_epu8(va, vb), _mm512_subs_epu8(vb, va));
+      __m512i lo = _mm512_unpacklo_epi8(d, zero);
+      __m512i hi = _mm512_unpackhi_epi8(d, zero);
+      acc = _mm512_dpwssd_epi32(acc, lo, lo);
+      acc = _mm512_dpwssd_epi32(acc, hi, hi);
+    }
+    sum += _mm512_reduce_add_epi32(acc);
+    if (sum >= threshold) return sum;
+  }
+  return sum + ssd_tail(a, b, i, len);
+}
+
+static int supports_scalar() { return 1; }
+static int supports_sse41() { return __builtin_cpu_supports("sse4.1"); }
+static int supports_avx2() { return __builtin_cpu_supports("avx2"); }
+static int supports_avx512bw() {
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+static int supports_avx512vnni() {
+  return supports_avx512bw() && __builtin_cpu_supports("avx512vnni");
+}
+
+typedef struct {
+  const char *name;
+  SSDKernel kernel;
+  int (*supported)();
+} SSDEntry;
+
+// Ordered from the fastest to the slowest
+static const SSDEntry ssd_entries[] = {
+    {"avx512vnni", ssd_avx512vnni, supports_avx512vnni},
+    {"avx512bw", ssd_avx512bw, supports_avx512bw},
+    {"avx2", ssd_avx2, supports_avx2},
+    {"sse4.1", ssd_sse41, supports_sse41},
+    {"scalar", ssd_scalar, supports_scalar},
+};
+
+#define NUM_SSD_ENTRIES (sizeof(ssd_entries) / sizeof(ssd_entries[0]))
+
+SSDKernel ssd_select(const char **name) {
+  const char *forced = getenv("PHOTOMOSAIC_SSD");
+  if (forced != NULL && *forced != '\0') {
+    SSDKernel kernel = ssd_kernel_by_name(forced);
+    if (kernel == NULL) {
+      log_error("SSD kernel %s is unknown or not supported by this CPU", forced);
+      exit(EXIT_FAILURE);
+    }
+    if (name) *name = forced;
+    return kernel;
+  }
+
+  __builtin_cpu_init();
+  for (int k = 0; k < NUM_SSD_ENTRIES; k++) {
+    if (ssd_entries[k].supported()) {
+      if (name) *name = ssd_entries[k].name;
+      return ssd_entries[k].kernel;
+    }
+  }
+  return NULL;
+}
+
+SSDKernel ssd_kernel_by_name(const char *name) {
+  __builtin_cpu_init();
+  for (int k = 0; k < NUM_SSD_ENTRIES; k++) {
+    if (strcmp(ssd_entries[k].name, name) == 0) {
+      return ssd_entries[k].supported() ? ssd_entries[k].kernel : NULL;
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+/**
+ * Sum of squared differences between two uint8 buffers of length len.
+ * Kernels check the running sum against threshold every SSD_BLOCK bytes and return the partial
+ * sum as soon as it reaches threshold, so a result >= threshold is only a lower bound.
+ */
+typedef int (*SSDKernel)(const unsigned char *a, const unsigned char *b, int len, int threshold);
+
+#define SSD_BLOCK 256
+
+/**
+ * Pick the fastest kernel supported by the running CPU, or the one named by $PHOTOMOSAIC_SSD
+ * (exits if that one is unknown or unsupported), e.g. to check a SIMD variant against "scalar"
+ * @param name set to the name of the chosen kernel if not NULL
+ */
+SSDKernel ssd_select(const char **name);
+
+/**
+ * Look up a kernel by name ("scalar", "sse4.1", "avx2", "avx512bw", "avx512vnni")
+ * @return NULL if the kernel is unknown or not supported by the running CPU
+ */
+SSDKernel ssd_kernel_by_name(const char *name);
@@ -0,0 +1,70 @@
+#include "stream.h"
+#include <limits.h>
+#include <log/log.h>
+#include <omp.h>
+#include <stdlib.h>
+#include "bounds.h"
+
+#define W 32
+#define H 32
+#define C 3
+#define TILE_LEN (H * W * C)
+
+/**
+ * Channel sums of count CHW tiles
+ * @param sums output buffer of count x C ints
+ */
+static void channel_sums(const unsigned char *tiles, int count, int *sums) {
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < count; ++i) {
+    const unsigned char *tile = tiles + (size_t)i * TILE_LEN;
+    for (int c = 0; c < C; ++c) {
+      int sum = 0;
+      for (int k = 0; k < H * W; ++k) {
+        sum += tile[c * H * W + k];
+      }
+      sums[i * C + c] = sum;
+    }
+  }
+}
+
+void stream_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset, SSDKernel ssd,
+                  int chunk_size, int *indices) {
+  int *tile_sums = (int *)malloc(num_tiles * C * sizeof(int));
+  int *chunk_sums = (int *)malloc(chunk_size * C * sizeof(int));
+  int *min_dist = (int *)malloc(num_tiles * sizeof(int));
+  channel_sums(tiles, num_tiles, tile_sums);
+  for (int t = 0; t < num_tiles; ++t) {
+    min_dist[t] = INT_MAX;
+    indices[t] = 0;
+  }
+  log_debug("[photomosaic] Streaming %d images in chunks of %d (2 x %.1f MB)", dataset->count,
+            chunk_size, (double)chunk_size * TILE_LEN / (1 << 20));
+
+  DatasetStream *stream = dataset_stream_begin(dataset, chunk_size);
+  const unsigned char *chunk;
+  int begin, count, num_chunks = 0;
+  while ((count = dataset_stream_next(stream, &chunk, &begin)) > 0) {
+    channel_sums(chunk, count, chunk_sums);
+    // Chunks arrive in index order, so a strict comparison keeps the lowest index on ties
+#pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < num_tiles; ++t) {
+      const unsigned char *tile = tiles + (size_t)t * TILE_LEN;
+      for (int i = 0; i < count; ++i) {
+        if (mean_bound(tile_sums + t * C, chunk_sums + i * C) >= min_dist[t]) continue;
+        int d = ssd(tile, chunk + (size_t)i * TILE_LEN, TILE_LEN, min_dist[t]);
+        if (d < min_dist[t]) {
+          min_dist[t] = d;
+          indices[t] = begin + i;
+        }
+      }
+    }
+    num_chunks++;
+  }
+  dataset_stream_end(stream);
+  log_debug("[photomosaic] Scanned %d chunks", num_chunks);
+
+  free(tile_sums);
+  free(chunk_sums);
+  free(min_dist);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <dataset.h>
+#include "ssd.h"
+
+/**
+ * Exact linear scan over a streamed dataset, chunk_size images at a time, keeping a running best
+ * for every tile across chunks. Memory stays at two chunks whatever the dataset size.
+ * @param dataset opened with dataset_open_streamed()
+ * @param tiles CHW tiles of length TILE_LEN each
+ * @param indices output dataset index for each tile
+ */
+void stream_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset, SSDKernel ssd,
+                  int chunk_size, int *indices);
@@ -0,0 +1,42 @@
+#pragma once
+
+/**
+ * Whether candidate i with distance (or bound) d ranks before (best_d, best_i). Comparing the
+ * index as well keeps the lowest index on ties even when candidates are not visited in order.
+ */
+static inline int beats(int d, int i, int best_d, int best_i) {
+  return d < best_d || (d == best_d && i < best_i);
+}
+
+/**
+ * Offer (d, i) to a max-heap holding the k best candidates seen so far; the root is the worst
+ * one kept
+ */
+static inline void topk_push(int *ds, int *ids, int *size, int k, int d, int i) {
+  int p;
+  if (*size < k) {
+    // Append and sift up
+    p = (*size)++;
+    while (p > 0 && beats(ds[(p - 1) / 2], ids[(p - 1) / 2], d, i)) {
+      ds[p] = ds[(p - 1) / 2];
+      ids[p] = ids[(p - 1) / 2];
+      p = (p - 1) / 2;
+    }
+  } else if (beats(d, i, ds[0], ids[0])) {
+    // Replace the root and sift down
+    p = 0;
+    for (;;) {
+      int child = 2 * p + 1;
+      if (child >= k) break;
+      if (child + 1 < k && beats(ds[child], ids[child], ds[child + 1], ids[child + 1])) child++;
+      if (!beats(d, i, ds[child], ids[child])) break;
+      ds[p] = ds[child];
+      ids[p] = ids[child];
+      p = child;
+    }
+  } else {
+    return;
+  }
+  ds[p] = d;
+  ids[p] = i;
+}
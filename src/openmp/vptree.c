@@ -0,0 +1,94 @@
+#include "vptree.h"
+#include <limits.h>
+#include <log/log.h>
+#include <math.h>
+#include <omp.h>
+#include <stdlib.h>
+#include "bounds.h"
+#include "topk.h"
+
+#define W 32
+#define H 32
+#define C 3
+#define TILE_LEN (H * W * C)
+
+// Slack on the triangle-inequality bound so that rounding in sqrt never prunes an exact tie
+#define VPT_EPS 1e-6
+
+typedef struct {
+  const unsigned char *tile;
+  int sums[C];
+  const Dataset *dataset;
+  const VPNode *nodes;
+  const int *ids;
+  SSDKernel ssd;
+  int min_dist;
+  int min_i;
+  long long num_dist;
+} VPSearch;
+
+static inline void visit(VPSearch *s, int i, int d) {
+  if (beats(d, i, s->min_dist, s->min_i)) {
+    s->min_dist = d;
+    s->min_i = i;
+  }
+}
+
+static void search_node(VPSearch *s, int node) {
+  const VPNode *v = s->nodes + node;
+  const Dataset *dataset = s->dataset;
+  if (v->vp < 0) {
+    for (int k = v->begin; k < v->end; ++k) {
+      int i = s->ids[k];
+      int lb = mean_bound(s->sums, dataset->sums + i * C);
+      if (lb > s->min_dist || (lb == s->min_dist && i > s->min_i)) continue;
+      int threshold = s->min_dist == INT_MAX ? INT_MAX : s->min_dist + 1;
+      visit(s, i, s->ssd(s->tile, dataset->tiles + (size_t)i * TILE_LEN, TILE_LEN, threshold));
+      s->num_dist++;
+    }
+    return;
+  }
+
+  // The bounds need the exact distance to the vantage point, so it is never abandoned early
+  int d = s->ssd(s->tile, dataset->tiles + (size_t)v->vp * TILE_LEN, TILE_LEN, INT_MAX);
+  visit(s, v->vp, d);
+  s->num_dist++;
+
+  // Triangle inequality: |q - x| >= |vp - x| - |q - vp| and |q - vp| - |vp - x|
+  double q = sqrt(d);
+  double lb[2];
+  for (int c = 0; c < 2; ++c) {
+    lb[c] = fmax(0.0, fmax(sqrt(v->lo[c]) - q, q - sqrt(v->hi[c])));
+  }
+  int first = lb[1] < lb[0];
+  for (int c = first, n = 0; n < 2; c ^= 1, ++n) {
+    if (s->min_dist != INT_MAX && lb[c] > sqrt(s->min_dist) + VPT_EPS) continue;
+    search_node(s, v->child[c]);
+  }
+}
+
+void vptree_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset, SSDKernel ssd,
+                  int *indices) {
+  const VPNode *nodes = dataset_section(dataset, SECTION_VPT_NODES, NULL);
+  const int *ids = dataset_section(dataset, SECTION_VPT_IDS, NULL);
+  if (nodes == NULL || ids == NULL) {
+    log_error("The dataset has no VP-tree; rebuild it with build_index -t");
+    exit(EXIT_FAILURE);
+  }
+
+  long long num_dist = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+ : num_dist)
+  for (int t = 0; t < num_tiles; ++t) {
+    VPSearch s = {tiles + (size_t)t * TILE_LEN, {0, 0, 0}, dataset, nodes, ids, ssd, INT_MAX, 0,
+                  0};
+    for (int k = 0; k < TILE_LEN; ++k) {
+      s.sums[k / (H * W)] += s.tile[k];
+    }
+    search_node(&s, 0);
+    indices[t] = s.min_i;
+    num_dist += s.num_dist;
+  }
+
+  log_debug("[photomosaic] VP-tree computed %.1f distances per tile on average",
+            num_tiles > 0 ? (double)num_dist / num_tiles : 0.0);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <dataset.h>
+#include "ssd.h"
+
+/**
+ * Exact branch-and-bound search over the vantage-point tree sections of the index. Returns the
+ * same indices as the linear scan.
+ * @param tiles CHW tiles of length TILE_LEN each
+ * @param indices output dataset index for each tile
+ */
+void vptree_match(const unsigned char *tiles, int num_tiles, const Dataset *dataset, SSDKernel ssd,
+                  int *indices);
@@ -0,0 +1,96 @@
+#define _POSIX_C_SOURCE 200809L
+#include "options.h"
+#include <log/log.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+Options options = {
+    .search = "linear",
+    .topk = 0,
+    .nprobe = 8,
+    .opencl_block = 0,
+    .dataset = NULL,
+    .stream_chunk = 0,
+    .batch = 0,
+    .socket = NULL,
+    .devices = NULL,
+    .threads = 0,
+};
+
+void print_usage(const char *prog) {
+  log_error("Usage: %s [options] [input.bmp] [output.bmp]", prog);
+  log_error("       %s [options] -B [input directory or manifest] [output directory]", prog);
+  log_error("       %s [options] -S <socket>", prog);
+  log_error("  -d <path>    dataset index, or raw CIFAR-10 dump (default: %s, else %s)",
+            DEFAULT_INDEX, DEFAULT_RAW);
+  log_error("  -s <search>  search engine (default: %s)", options.search);
+  log_error("               linear: per-tile scan with lower-bound pruning");
+  log_error("               ordered: linear scan comparing extreme pixels first (omp only)");
+  log_error("               soa: linear scan over 32 interleaved candidates at a time (omp only)");
+  log_error("               gemm: blocked matrix product over all tiles at once (omp only)");
+  log_error("               pyramid: thumbnail bounds first, full SSD on the survivors");
+  log_error("               tiled: linear scan, several tiles per work-group (OpenCL only)");
+  log_error("               vptree: exact, branch-and-bound over a vantage-point tree (omp only)");
+  log_error("               pca: exact, PCA-projected lower bounds skip candidates (omp only)");
+  log_error("               ivf: approximate, scans only the nearest k-means clusters (omp only)");
+  log_error("               pq: approximate, scores product-quantized codes (omp only)");
+  log_error("  -k <topk>    candidates reranked by the omp pyramid (0 for exact) and pq (0 for "
+            "32) searches (default: %d)",
+            options.topk);
+  log_error("  -n <nprobe>  clusters probed per tile by the ivf search (default: %d)",
+            options.nprobe);
+  log_error("  -b <images>  OpenCL dataset block per kernel launch, 0 to disable (default: %d)",
+            options.opencl_block);
+  log_error("  -m <images>  omp streams the dataset from disk in chunks of this many images, 0");
+  log_error("               loads it whole (default: %d)", options.stream_chunk);
+  log_error("  -B           batch mode: match every image with one warm matcher (not for mpi)");
+  log_error("  -S <path>    server mode: answer mosaic requests on this Unix socket until SIGINT");
+  log_error("               or SIGTERM, keeping the dataset and devices warm (not for mpi)");
+  log_error("  -g <devices> OpenCL devices to use, comma-separated: all, gpu, cpu, accelerator, a");
+  log_error("               device index or part of a device or platform name (default: gpu if");
+  log_error("               there is one, else all)");
+  log_error("  -t <threads> OpenMP threads (default: 32 for omp; for mpi_omp, the node's cores");
+  log_error("               shared among its ranks)");
+}
+
+int parse_options(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "d:s:k:n:b:m:BS:g:t:")) != -1) {
+    switch (opt) {
+      case 'd':
+        options.dataset = optarg;
+        break;
+      case 's':
+        options.search = optarg;
+        break;
+      case 'k':
+        options.topk = atoi(optarg);
+        break;
+      case 'n':
+        options.nprobe = atoi(optarg);
+        break;
+      case 'b':
+        options.opencl_block = atoi(optarg);
+        break;
+      case 'm':
+        options.stream_chunk = atoi(optarg);
+        break;
+      case 'B':
+        options.batch = 1;
+        break;
+      case 'S':
+        options.socket = optarg;
+        break;
+      case 'g':
+        options.devices = optarg;
+        break;
+      case 't':
+        options.threads = atoi(optarg);
+        break;
+      default:
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  return optind;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+/**
+ * Runtime options shared by every implementation
+ */
+typedef struct {
+  const char *search;  // Search engine, see print_usage()
+  int topk;            // Candidates reranked by approximate searches, 0 keeps them exact
+  int nprobe;          // Clusters probed per tile by the IVF search
+  int opencl_block;    // Dataset images per OpenCL launch, 0 scans the whole dataset at once
+  const char *dataset; // Index or raw dataset path, NULL picks the default
+  int stream_chunk;    // Dataset images per streamed chunk, 0 loads the whole dataset
+  int batch;           // Inputs are a directory or manifest, outputs go to a directory
+  const char *socket;  // Serve mosaics on this Unix socket instead of reading an input, or NULL
+  const char *devices; // OpenCL device selector, see print_usage(), NULL picks the GPUs
+  int threads;         // OpenMP threads per process, 0 picks the target's default
+} Options;
+
+#define DEFAULT_INDEX "data/cifar-10.idx"
+#define DEFAULT_RAW "data/cifar-10.bin"
+
+extern Options options;
+
+/**
+ * Parse leading command line flags into options
+ * @return index of the first positional argument
+ */
+int parse_options(int argc, char **argv);
+void print_usage(const char *prog);
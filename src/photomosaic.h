@@ -1,7 +1,29 @@
 #pragma once
 
-void photomosaic(unsigned char *image, int width, int height, const unsigned char *dataset,
+#include "dataset.h"
+
+void photomosaic(unsigned char *image, int width, int height, const Dataset *dataset,
                  int *indices);
 
-void photomosaic_mpi(unsigned char *image, int width, int height, const unsigned char *dataset,
+/**
+ * Collective over MPI_COMM_WORLD; indices are only filled on rank 0
+ * @param image held by rank 0 and overwritten, NULL on the other ranks
+ */
+void photomosaic_mpi(unsigned char *image, int width, int height, const Dataset *dataset,
                      int *indices, int world_rank, int world_size);
+
+/**
+ * Matcher state kept warm across images: the dataset and, for the OpenCL targets, the devices,
+ * the compiled programs and the dataset copies on the devices; for omp, what the search engine
+ * derives from the dataset. photomosaic() is one create/run/destroy round.
+ */
+typedef struct Photomosaic Photomosaic;
+
+Photomosaic *photomosaic_create(const Dataset *dataset);
+
+/**
+ * Same contract as photomosaic(); image may be overwritten
+ */
+void photomosaic_run(Photomosaic *mosaic, unsigned char *image, int width, int height,
+                     int *indices);
+void photomosaic_destroy(Photomosaic *mosaic);
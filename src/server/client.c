@@ -0,0 +1,40 @@
+#define _POSIX_C_SOURCE 200809L
+#include "client.h"
+#include <log/log.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "protocol.h"
+
+int mosaic_connect(const char *socket_path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    log_error("Failed to connect to %s", socket_path);
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int mosaic_request(int fd, const unsigned char *image, int width, int height,
+                   unsigned char *mosaic) {
+  size_t size = (size_t)width * height * 3;
+  MosaicRequest request = {MOSAIC_REQUEST_MAGIC, width, height, 0};
+  if (mosaic_write_full(fd, &request, sizeof(request)) != 0 ||
+      mosaic_write_full(fd, image, size) != 0) {
+    return -1;
+  }
+  MosaicResponse response;
+  if (mosaic_read_full(fd, &response, sizeof(response)) != 0 ||
+      response.magic != MOSAIC_RESPONSE_MAGIC) {
+    return -1;
+  }
+  if (response.status != MOSAIC_OK) return response.status;
+  if (response.width != width || response.height != height) return -1;
+  return mosaic_read_full(fd, mosaic, size) == 0 ? MOSAIC_OK : -1;
+}
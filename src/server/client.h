@@ -0,0 +1,15 @@
+#pragma once
+
+/**
+ * Connect to a mosaic daemon
+ * @return socket descriptor, or -1 after logging the error
+ */
+int mosaic_connect(const char *socket_path);
+
+/**
+ * Send one image on a connection and wait for its mosaic
+ * @param mosaic output buffer of width x height x 3 bytes
+ * @return the response status, or -1 if the connection failed
+ */
+int mosaic_request(int fd, const unsigned char *image, int width, int height,
+                   unsigned char *mosaic);
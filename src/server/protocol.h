@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Mosaic daemon wire protocol over a Unix stream socket, native byte order.
+ *
+ * A client sends any number of requests on one connection, each a MosaicRequest followed by
+ * width x height x 3 bytes of HWC RGB pixels, and reads one MosaicResponse per request. A
+ * response with status MOSAIC_OK is followed by the mosaic in the same layout; other statuses
+ * carry no payload.
+ */
+
+#define MOSAIC_REQUEST_MAGIC 0x51524d50u   // "PMRQ"
+#define MOSAIC_RESPONSE_MAGIC 0x53524d50u  // "PMRS"
+#define MOSAIC_MAX_PIXELS (8192 * 8192)
+#define DEFAULT_SOCKET "/tmp/photomosaic.sock"
+
+enum {
+  MOSAIC_OK = 0,
+  MOSAIC_BAD_REQUEST,  // Bad magic, or sides not multiples of 32, or too many pixels
+};
+
+typedef struct {
+  uint32_t magic;
+  uint32_t width;
+  uint32_t height;
+  uint32_t reserved;
+} MosaicRequest;
+
+typedef struct {
+  uint32_t magic;
+  int32_t status;
+  uint32_t width;
+  uint32_t height;
+} MosaicResponse;
+
+/**
+ * Read or write exactly size bytes, retrying short transfers
+ * @return 0 on success, -1 on error or end of stream
+ */
+int mosaic_read_full(int fd, void *buf, size_t size);
+int mosaic_write_full(int fd, const void *buf, size_t size);
@@ -0,0 +1,296 @@
+#define _POSIX_C_SOURCE 200809L
+#include "server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <log/log.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "image.h"
+#include "photomosaic.h"
+#include "protocol.h"
+#include "util.h"
+
+#define SERVER_WORKERS 4       // Requests served at once
+#define SERVER_CONNECTIONS 64  // Open connections; beyond this clients wait in the backlog
+#define SERVER_BACKLOG 64
+#define SERVER_TIMEOUT 30  // Seconds a worker waits on a client stalled inside a request
+
+static volatile sig_atomic_t stopping = 0;
+static int wake_pipe[2] = {-1, -1};  // Wakes the acceptor out of poll()
+
+static void wake_acceptor() {
+  // Non-blocking: when the pipe is full a wakeup is already pending
+  while (write(wake_pipe[1], "", 1) < 0 && errno == EINTR) continue;
+}
+
+static void handle_stop(int sig) {
+  (void)sig;
+  int saved_errno = errno;
+  stopping = 1;
+  wake_acceptor();
+  errno = saved_errno;
+}
+
+typedef struct {
+  const Dataset *dataset;
+  Photomosaic *mosaic;
+  pthread_mutex_t match_lock;  // The matcher holds one image at a time
+
+  int ready[SERVER_CONNECTIONS];  // Connections with a request waiting, for the workers
+  int head;
+  int count;
+  int returned[SERVER_CONNECTIONS];  // Connections handed back by the workers after a request
+  int num_returned;
+  int num_open;
+  int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+
+  long num_requests;
+  long num_failed;
+  double busy_time;
+} Server;
+
+/**
+ * Take the oldest connection with a request waiting, blocking while there is none
+ * @return -1 once the server is closed and drained
+ */
+static int pop_connection(Server *s) {
+  pthread_mutex_lock(&s->lock);
+  while (s->count == 0 && !s->closed) pthread_cond_wait(&s->not_empty, &s->lock);
+  int fd = -1;
+  if (s->count > 0) {
+    fd = s->ready[s->head];
+    s->head = (s->head + 1) % SERVER_CONNECTIONS;
+    s->count--;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return fd;
+}
+
+/**
+ * Answer one request
+ * @return 0 to keep reading from the connection, -1 to drop it
+ */
+static int serve_request(Server *s, int fd) {
+  MosaicRequest request;
+  if (mosaic_read_full(fd, &request, sizeof(request)) != 0) return -1;  // Client hung up
+  double start = timer_now();
+  MosaicResponse response = {MOSAIC_RESPONSE_MAGIC, MOSAIC_OK, request.width, request.height};
+  if (request.magic != MOSAIC_REQUEST_MAGIC || request.width == 0 || request.height == 0 ||
+      request.width % 32 != 0 || request.height % 32 != 0 ||
+      (uint64_t)request.width * request.height > MOSAIC_MAX_PIXELS) {
+    log_warn("[server] rejected request: magic %08x, %ux%u", request.magic, request.width,
+             request.height);
+    response.status = MOSAIC_BAD_REQUEST;
+    mosaic_write_full(fd, &response, sizeof(response));
+    // The payload size is unknown or untrusted, so the stream cannot be resynchronized
+    return -1;
+  }
+
+  int width = request.width, height = request.height;
+  size_t size = (size_t)width * height * 3;
+  unsigned char *image = (unsigned char *)malloc(size);
+  int *indices = (int *)malloc((width / 32) * (height / 32) * sizeof(int));
+  int status = mosaic_read_full(fd, image, size);
+  if (status == 0) {
+    pthread_mutex_lock(&s->match_lock);
+    photomosaic_run(s->mosaic, image, width, height, indices);
+    pthread_mutex_unlock(&s->match_lock);
+    image_compose(s->dataset, indices, width, height, image);
+    status = mosaic_write_full(fd, &response, sizeof(response));
+    if (status == 0) status = mosaic_write_full(fd, image, size);
+  }
+  free(image);
+  free(indices);
+
+  double elapsed = timer_now() - start;
+  pthread_mutex_lock(&s->lock);
+  s->num_requests++;
+  if (status != 0) s->num_failed++;
+  s->busy_time += elapsed;
+  pthread_mutex_unlock(&s->lock);
+  if (status == 0) log_debug("[server] %dx%d in %.1f ms", width, height, elapsed * 1e3);
+  return status;
+}
+
+static void *worker_main(void *arg) {
+  Server *s = (Server *)arg;
+  int fd;
+  while ((fd = pop_connection(s)) >= 0) {
+    // One request per turn: the connection goes back to the acceptor, which hands it out again
+    // once the next request arrives, so idle clients never hold a worker
+    int status = serve_request(s, fd);
+    pthread_mutex_lock(&s->lock);
+    if (status == 0 && !s->closed) {
+      s->returned[s->num_returned++] = fd;
+      fd = -1;
+    } else {
+      s->num_open--;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (fd >= 0) close(fd);
+    wake_acceptor();
+  }
+  return NULL;
+}
+
+static int listen_on(const char *socket_path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    log_error("Socket path too long: %s", socket_path);
+    return -1;
+  }
+  strcpy(addr.sun_path, socket_path);
+  unlink(socket_path);  // Left behind by a server that did not shut down cleanly
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, SERVER_BACKLOG) != 0) {
+    log_error("Failed to listen on %s: %s", socket_path, strerror(errno));
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Accept connections and hand those with a request waiting to the workers until stopped
+ */
+static void accept_loop(Server *s, int listener) {
+  struct pollfd fds[SERVER_CONNECTIONS + 2];
+  int waiting[SERVER_CONNECTIONS];  // Open connections between requests
+  int num_waiting = 0;
+  while (!stopping) {
+    pthread_mutex_lock(&s->lock);
+    while (s->num_returned > 0) waiting[num_waiting++] = s->returned[--s->num_returned];
+    // Backpressure: stop accepting at the connection limit, further clients wait in the backlog
+    int accepting = s->num_open < SERVER_CONNECTIONS;
+    pthread_mutex_unlock(&s->lock);
+
+    int n = 0;
+    fds[n++] = (struct pollfd){wake_pipe[0], POLLIN, 0};
+    if (accepting) fds[n++] = (struct pollfd){listener, POLLIN, 0};
+    int first = n;
+    for (int i = 0; i < num_waiting; ++i) fds[n++] = (struct pollfd){waiting[i], POLLIN, 0};
+    if (poll(fds, n, -1) < 0) {
+      if (errno != EINTR) log_warn("[server] poll: %s", strerror(errno));
+      continue;
+    }
+    if (fds[0].revents & POLLIN) {
+      char drain[64];
+      while (read(wake_pipe[0], drain, sizeof(drain)) > 0) continue;
+    }
+
+    // A request or a hangup: either way a worker reads it
+    int kept = 0;
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < num_waiting; ++i) {
+      if (fds[first + i].revents) {
+        s->ready[(s->head + s->count++) % SERVER_CONNECTIONS] = waiting[i];
+        pthread_cond_signal(&s->not_empty);
+      } else {
+        waiting[kept++] = waiting[i];
+      }
+    }
+    pthread_mutex_unlock(&s->lock);
+    num_waiting = kept;
+
+    if (accepting && (fds[1].revents & POLLIN)) {
+      int fd = accept(listener, NULL, NULL);
+      if (fd < 0) {
+        if (errno != EINTR) log_warn("[server] accept: %s", strerror(errno));
+        continue;
+      }
+      // Bounds how long a client that stalls inside a request can hold its worker
+      struct timeval timeout = {SERVER_TIMEOUT, 0};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      pthread_mutex_lock(&s->lock);
+      s->num_open++;
+      pthread_mutex_unlock(&s->lock);
+      waiting[num_waiting++] = fd;
+    }
+  }
+  for (int i = 0; i < num_waiting; ++i) close(waiting[i]);
+}
+
+int server_run(const char *socket_path, const Dataset *dataset) {
+  if (pipe(wake_pipe) != 0) {
+    log_error("Failed to create the wake pipe: %s", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < 2; ++i) fcntl(wake_pipe[i], F_SETFL, O_NONBLOCK);
+
+  // Stop signals write to the wake pipe, so they also end a poll() that has not started yet
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_stop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);  // Clients hanging up surface as write errors instead
+
+  log_use_mutex();  // Workers log from their own threads
+  int listener = listen_on(socket_path);
+  if (listener < 0) {
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    return EXIT_FAILURE;
+  }
+
+  Server s;
+  memset(&s, 0, sizeof(s));
+  s.dataset = dataset;
+  pthread_mutex_init(&s.match_lock, NULL);
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_cond_init(&s.not_empty, NULL);
+  s.mosaic = photomosaic_create(dataset);
+
+  // Workers (and the OpenMP threads they start) block the stop signals, so that they always
+  // land on this thread
+  sigset_t stop_signals, old_mask;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+  pthread_t threads[SERVER_WORKERS];
+  for (int i = 0; i < SERVER_WORKERS; ++i) pthread_create(&threads[i], NULL, worker_main, &s);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  log_info("[server] listening on %s with %d workers", socket_path, SERVER_WORKERS);
+
+  double start = timer_now();
+  accept_loop(&s, listener);
+
+  // Let in-flight requests finish; the connections waiting for a worker are dropped
+  log_info("[server] shutting down");
+  close(listener);
+  unlink(socket_path);
+  pthread_mutex_lock(&s.lock);
+  s.closed = 1;
+  for (; s.count > 0; s.count--, s.head = (s.head + 1) % SERVER_CONNECTIONS) {
+    close(s.ready[s.head]);
+  }
+  pthread_cond_broadcast(&s.not_empty);
+  pthread_mutex_unlock(&s.lock);
+  for (int i = 0; i < SERVER_WORKERS; ++i) pthread_join(threads[i], NULL);
+  while (s.num_returned > 0) close(s.returned[--s.num_returned]);
+
+  double elapsed = timer_now() - start;
+  log_info("[server] %ld requests (%ld failed) in %.2f s, %.1f ms average", s.num_requests,
+           s.num_failed, elapsed, s.num_requests ? s.busy_time * 1e3 / s.num_requests : 0.0);
+  photomosaic_destroy(s.mosaic);
+  pthread_mutex_destroy(&s.match_lock);
+  pthread_mutex_destroy(&s.lock);
+  pthread_cond_destroy(&s.not_empty);
+  close(wake_pipe[0]);
+  close(wake_pipe[1]);
+  return 0;
+}
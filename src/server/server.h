@@ -0,0 +1,14 @@
+#pragma once
+
+#include "dataset.h"
+
+/**
+ * Serve mosaics over a Unix domain socket (see protocol.h) with one dataset and one warm
+ * matcher until SIGINT or SIGTERM. The acceptor polls the open connections and hands each
+ * request to a fixed pool of workers, which give the connection back once they have answered,
+ * so idle clients hold no worker. At 64 open connections it stops accepting and further clients
+ * wait in the listen backlog. Workers read and encode in parallel, matching runs one image at a
+ * time.
+ * @return 0 after a clean shutdown, nonzero if the socket could not be set up
+ */
+int server_run(const char *socket_path, const Dataset *dataset);
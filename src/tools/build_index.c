@@ -0,0 +1,301 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dataset.h>
+#include <limits.h>
+#include <log/log.h>
+#include <openmp/pca.h>
+#include <openmp/soa.h>
+#include <openmp/ssd.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <util.h>
+#include "kmeans.h"
+#include "pca.h"
+
+#define W 32
+#define H 32
+#define C 3
+#define TILE_LEN (W * H * C)
+
+#define KMEANS_ITERS 10
+#define KMEANS_SAMPLES_PER_CLUSTER 64
+#define PQ_CENTROIDS 256
+#define VPT_LEAF_SIZE 32
+#define PCA_ITERS 10
+#define PCA_SAMPLES 4096
+
+static void print_usage(const char *prog) {
+  log_error("Usage: %s [options] [cifar-10.bin] [cifar-10.idx]", prog);
+  log_error("  -i <nlist>  add an IVF index with nlist k-means clusters");
+  log_error("  -p <m>      add product-quantized codes with m subquantizers (m divides %d)",
+            TILE_LEN);
+  log_error("  -c <dims>   add PCA coordinates with dims components for exact lower bounds");
+  log_error("  -l          add a copy of the tiles interleaved for SIMD across candidates");
+  log_error("  -t          add a vantage-point tree for exact sublinear search");
+}
+
+/**
+ * Cluster the tiles with k-means trained on a strided sample and store the inverted lists
+ */
+static void build_ivf(const Dataset *dataset, int nlist, IndexPayload *payloads,
+                      int *num_payloads) {
+  timer_start();
+  unsigned char *centroids = (unsigned char *)malloc((size_t)nlist * TILE_LEN);
+  int step = dataset->count / (nlist * KMEANS_SAMPLES_PER_CLUSTER);
+  if (step < 1) step = 1;
+  kmeans_train(dataset->tiles, dataset->count / step, TILE_LEN, (size_t)step * TILE_LEN, nlist,
+               KMEANS_ITERS, centroids);
+
+  int *assign = (int *)malloc(dataset->count * sizeof(int));
+  kmeans_assign(dataset->tiles, dataset->count, TILE_LEN, TILE_LEN, centroids, nlist, assign);
+
+  int *offsets = (int *)calloc(nlist + 1, sizeof(int));
+  int *ids = (int *)malloc(dataset->count * sizeof(int));
+  for (int i = 0; i < dataset->count; ++i) {
+    offsets[assign[i] + 1]++;
+  }
+  for (int c = 0; c < nlist; ++c) {
+    offsets[c + 1] += offsets[c];
+  }
+  int *fill = (int *)malloc(nlist * sizeof(int));
+  for (int c = 0; c < nlist; ++c) {
+    fill[c] = offsets[c];
+  }
+  for (int i = 0; i < dataset->count; ++i) {
+    ids[fill[assign[i]]++] = i;
+  }
+  free(fill);
+  free(assign);
+  timer_stop_and_log("[index] IVF build time");
+
+  payloads[(*num_payloads)++] =
+      (IndexPayload){SECTION_IVF_CENTROIDS, centroids, (size_t)nlist * TILE_LEN};
+  payloads[(*num_payloads)++] =
+      (IndexPayload){SECTION_IVF_OFFSETS, offsets, (nlist + 1) * sizeof(int)};
+  payloads[(*num_payloads)++] =
+      (IndexPayload){SECTION_IVF_IDS, ids, dataset->count * sizeof(int)};
+}
+
+/**
+ * Split each tile into m contiguous subvectors, train a 256-centroid codebook per subvector and
+ * encode every image as m centroid indices
+ */
+static void build_pq(const Dataset *dataset, int m, IndexPayload *payloads, int *num_payloads) {
+  timer_start();
+  int dsub = TILE_LEN / m;
+  unsigned char *codebooks = (unsigned char *)malloc((size_t)m * PQ_CENTROIDS * dsub);
+  unsigned char *codes = (unsigned char *)malloc((size_t)dataset->count * m);
+  int *assign = (int *)malloc(dataset->count * sizeof(int));
+  int step = dataset->count / (PQ_CENTROIDS * KMEANS_SAMPLES_PER_CLUSTER);
+  if (step < 1) step = 1;
+  for (int s = 0; s < m; ++s) {
+    unsigned char *codebook = codebooks + (size_t)s * PQ_CENTROIDS * dsub;
+    kmeans_train(dataset->tiles + s * dsub, dataset->count / step, dsub, (size_t)step * TILE_LEN,
+                 PQ_CENTROIDS, KMEANS_ITERS, codebook);
+    kmeans_assign(dataset->tiles + s * dsub, dataset->count, dsub, TILE_LEN, codebook,
+                  PQ_CENTROIDS, assign);
+    for (int i = 0; i < dataset->count; ++i) {
+      codes[(size_t)i * m + s] = assign[i];
+    }
+  }
+  free(assign);
+  timer_stop_and_log("[index] PQ build time");
+
+  payloads[(*num_payloads)++] =
+      (IndexPayload){SECTION_PQ_CODEBOOKS, codebooks, (size_t)m * PQ_CENTROIDS * dsub};
+  payloads[(*num_payloads)++] =
+      (IndexPayload){SECTION_PQ_CODES, codes, (size_t)dataset->count * m};
+}
+
+/**
+ * Train a PCA basis on a strided sample and project every tile onto it
+ */
+static void build_pca(const Dataset *dataset, int dims, IndexPayload *payloads,
+                      int *num_payloads) {
+  timer_start();
+  float *mean = (float *)malloc(TILE_LEN * sizeof(float));
+  float *basis = (float *)malloc((size_t)dims * TILE_LEN * sizeof(float));
+  float *coords = (float *)malloc((size_t)dataset->count * dims * sizeof(float));
+  int step = dataset->count / PCA_SAMPLES;
+  if (step < 1) step = 1;
+  pca_train(dataset->tiles, dataset->count / step, TILE_LEN, (size_t)step * TILE_LEN, dims,
+            PCA_ITERS, mean, basis);
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < dataset->count; ++i) {
+    pca_project(dataset->tiles + (size_t)i * TILE_LEN, TILE_LEN, mean, basis, dims,
+                coords + (size_t)i * dims);
+  }
+  timer_stop_and_log("[index] PCA build time");
+
+  payloads[(*num_payloads)++] = (IndexPayload){SECTION_PCA_MEAN, mean, TILE_LEN * sizeof(float)};
+  payloads[(*num_payloads)++] =
+      (IndexPayload){SECTION_PCA_BASIS, basis, (size_t)dims * TILE_LEN * sizeof(float)};
+  payloads[(*num_payloads)++] =
+      (IndexPayload){SECTION_PCA_COORDS, coords, (size_t)dataset->count * dims * sizeof(float)};
+}
+
+/**
+ * Store the tiles in the candidate-interleaved layout read by the soa search
+ */
+static void build_soa(const Dataset *dataset, IndexPayload *payloads, int *num_payloads) {
+  timer_start();
+  size_t size = soa_size(dataset->count, TILE_LEN);
+  unsigned char *soa = (unsigned char *)malloc(size);
+  soa_interleave(dataset->tiles, dataset->count, TILE_LEN, soa);
+  timer_stop_and_log("[index] SoA build time");
+  payloads[(*num_payloads)++] = (IndexPayload){SECTION_SOA_TILES, soa, size};
+}
+
+typedef struct {
+  int dist;
+  int id;
+} Neighbor;
+
+static int compare_neighbors(const void *a, const void *b) {
+  const Neighbor *na = (const Neighbor *)a, *nb = (const Neighbor *)b;
+  if (na->dist != nb->dist) return na->dist < nb->dist ? -1 : 1;
+  return na->id - nb->id;
+}
+
+typedef struct {
+  const Dataset *dataset;
+  SSDKernel ssd;
+  VPNode *nodes;
+  int num_nodes;
+  int max_nodes;
+  int *ids;
+  Neighbor *scratch;
+} VPTreeBuilder;
+
+/**
+ * Build the subtree over ids[begin, end) and reorder that range so every leaf is contiguous
+ * @return index of the subtree root
+ */
+static int build_vp_node(VPTreeBuilder *b, int begin, int end) {
+  if (b->num_nodes == b->max_nodes) {
+    b->max_nodes *= 2;
+    b->nodes = (VPNode *)realloc(b->nodes, b->max_nodes * sizeof(VPNode));
+  }
+  int node = b->num_nodes++;
+  int n = end - begin;
+  if (n <= VPT_LEAF_SIZE) {
+    b->nodes[node] = (VPNode){-1, {-1, -1}, {0, 0}, {0, 0}, begin, end};
+    return node;
+  }
+
+  // A random vantage point; the rest are sorted by their distance to it and split in half
+  int vp = b->ids[begin + rand() % n];
+  int m = 0;
+  for (int k = begin; k < end; ++k) {
+    if (b->ids[k] != vp) b->scratch[begin + m++].id = b->ids[k];
+  }
+  Neighbor *neighbors = b->scratch + begin;
+  const unsigned char *tiles = b->dataset->tiles;
+#pragma omp parallel for schedule(static)
+  for (int k = 0; k < m; ++k) {
+    neighbors[k].dist = b->ssd(tiles + (size_t)vp * TILE_LEN,
+                               tiles + (size_t)neighbors[k].id * TILE_LEN, TILE_LEN, INT_MAX);
+  }
+  qsort(neighbors, m, sizeof(Neighbor), compare_neighbors);
+
+  int half = m / 2;
+  VPNode v = {vp, {-1, -1}, {neighbors[0].dist, neighbors[half].dist},
+              {neighbors[half - 1].dist, neighbors[m - 1].dist}, 0, 0};
+  for (int k = 0; k < m; ++k) {
+    b->ids[begin + k] = neighbors[k].id;
+  }
+  v.child[0] = build_vp_node(b, begin, begin + half);
+  v.child[1] = build_vp_node(b, begin + half, begin + m);
+  b->nodes[node] = v;
+  return node;
+}
+
+/**
+ * Build a vantage-point tree over the tiles in L2 space
+ */
+static void build_vptree(const Dataset *dataset, IndexPayload *payloads, int *num_payloads) {
+  timer_start();
+  VPTreeBuilder b = {dataset, ssd_select(NULL), NULL, 0, 1024, NULL, NULL};
+  b.nodes = (VPNode *)malloc(b.max_nodes * sizeof(VPNode));
+  b.ids = (int *)malloc(dataset->count * sizeof(int));
+  b.scratch = (Neighbor *)malloc(dataset->count * sizeof(Neighbor));
+  for (int i = 0; i < dataset->count; ++i) {
+    b.ids[i] = i;
+  }
+  srand(1);
+  build_vp_node(&b, 0, dataset->count);
+  free(b.scratch);
+  log_debug("[index] VP-tree with %d nodes", b.num_nodes);
+  timer_stop_and_log("[index] VP-tree build time");
+
+  payloads[(*num_payloads)++] =
+      (IndexPayload){SECTION_VPT_NODES, b.nodes, b.num_nodes * sizeof(VPNode)};
+  payloads[(*num_payloads)++] =
+      (IndexPayload){SECTION_VPT_IDS, b.ids, dataset->count * sizeof(int)};
+}
+
+int main(int argc, char **argv) {
+  int nlist = 0, m = 0, dims = 0, vptree = 0, soa = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:p:c:lt")) != -1) {
+    switch (opt) {
+      case 'i':
+        nlist = atoi(optarg);
+        break;
+      case 'p':
+        m = atoi(optarg);
+        if (m < 1 || TILE_LEN % m != 0) {
+          log_error("The number of subquantizers must divide %d", TILE_LEN);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'c':
+        dims = atoi(optarg);
+        if (dims < 1 || dims > TILE_LEN) {
+          log_error("The number of PCA components must be between 1 and %d", TILE_LEN);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'l':
+        soa = 1;
+        break;
+      case 't':
+        vptree = 1;
+        break;
+      default:
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (argc - optind != 2) {
+    print_usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  const char *input_path = argv[optind];
+  const char *output_path = argv[optind + 1];
+
+  timer_start();
+  Dataset *dataset = dataset_open(input_path);
+  log_debug("Loaded %d images", dataset->count);
+  timer_stop_and_log("[index] load time");
+
+  IndexPayload payloads[INDEX_MAX_SECTIONS];
+  int num_payloads = 0;
+  if (nlist > 0) build_ivf(dataset, nlist, payloads, &num_payloads);
+  if (m > 0) build_pq(dataset, m, payloads, &num_payloads);
+  if (dims > 0) build_pca(dataset, dims, payloads, &num_payloads);
+  if (vptree) build_vptree(dataset, payloads, &num_payloads);
+  if (soa) build_soa(dataset, payloads, &num_payloads);
+
+  timer_start();
+  if (dataset_write_index(dataset, output_path, payloads, num_payloads) != 0) {
+    exit(EXIT_FAILURE);
+  }
+  timer_stop_and_log("[index] write time");
+  log_debug("Index saved to %s", output_path);
+
+  for (int k = 0; k < num_payloads; ++k) {
+    free((void *)payloads[k].data);
+  }
+  dataset_close(dataset);
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include "kmeans.h"
+#include <limits.h>
+#include <log/log.h>
+#include <openmp/ssd.h>
+#include <stdlib.h>
+#include <string.h>
+
+void kmeans_assign(const unsigned char *data, int n, int dim, size_t stride,
+                   const unsigned char *centroids, int k, int *assign) {
+  SSDKernel ssd = ssd_select(NULL);
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < n; ++i) {
+    const unsigned char *v = data + i * stride;
+    int min_dist = INT_MAX, min_c = 0;
+    for (int c = 0; c < k; ++c) {
+      int d = ssd(v, centroids + (size_t)c * dim, dim, min_dist);
+      if (d < min_dist) {
+        min_dist = d;
+        min_c = c;
+      }
+    }
+    assign[i] = min_c;
+  }
+}
+
+void kmeans_train(const unsigned char *data, int n, int dim, size_t stride, int k, int iters,
+                  unsigned char *centroids) {
+  if (n < k) {
+    log_error("k-means needs at least %d vectors, got %d", k, n);
+    exit(EXIT_FAILURE);
+  }
+
+  // Evenly spaced vectors as initial centroids keep the build deterministic
+  for (int c = 0; c < k; ++c) {
+    memcpy(centroids + (size_t)c * dim, data + (size_t)c * (n / k) * stride, dim);
+  }
+
+  int *assign = (int *)malloc(n * sizeof(int));
+  long long *sums = (long long *)malloc((size_t)k * dim * sizeof(long long));
+  int *counts = (int *)malloc(k * sizeof(int));
+  for (int it = 0; it < iters; ++it) {
+    kmeans_assign(data, n, dim, stride, centroids, k, assign);
+
+    memset(sums, 0, (size_t)k * dim * sizeof(long long));
+    memset(counts, 0, k * sizeof(int));
+    for (int i = 0; i < n; ++i) {
+      const unsigned char *v = data + i * stride;
+      long long *sum = sums + (size_t)assign[i] * dim;
+      for (int j = 0; j < dim; ++j) {
+        sum[j] += v[j];
+      }
+      counts[assign[i]]++;
+    }
+
+    // Empty clusters keep their previous centroid
+    int num_empty = 0;
+    for (int c = 0; c < k; ++c) {
+      if (counts[c] == 0) {
+        num_empty++;
+        continue;
+      }
+      for (int j = 0; j < dim; ++j) {
+        centroids[(size_t)c * dim + j] =
+            (unsigned char)((sums[(size_t)c * dim + j] + counts[c] / 2) / counts[c]);
+      }
+    }
+    log_debug("[kmeans] iteration %d/%d, %d empty clusters", it + 1, iters, num_empty);
+  }
+
+  free(assign);
+  free(sums);
+  free(counts);
+}
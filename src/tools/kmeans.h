@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Lloyd's k-means over uint8 vectors with uint8 (rounded mean) centroids
+ * @param data first vector; vector i starts at data + i * stride
+ * @param n number of vectors used for training
+ * @param dim length of each vector
+ * @param centroids output buffer of k * dim bytes
+ */
+void kmeans_train(const unsigned char *data, int n, int dim, size_t stride, int k, int iters,
+                  unsigned char *centroids);
+
+/**
+ * Assign every vector to its nearest centroid, ties going to the lowest centroid
+ * @param assign output buffer of n ints
+ */
+void kmeans_assign(const unsigned char *data, int n, int dim, size_t stride,
+                   const unsigned char *centroids, int k, int *assign);
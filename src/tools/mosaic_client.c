@@ -0,0 +1,50 @@
+#define _POSIX_C_SOURCE 200809L
+#include <image.h>
+#include <log/log.h>
+#include <server/client.h>
+#include <server/protocol.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <util.h>
+
+static void print_usage(const char *prog) {
+  log_error("Usage: %s [options] [input.bmp] [output.bmp]", prog);
+  log_error("  -S <path>  socket of the mosaic server (default: %s)", DEFAULT_SOCKET);
+}
+
+int main(int argc, char **argv) {
+  const char *socket_path = DEFAULT_SOCKET;
+  int opt;
+  while ((opt = getopt(argc, argv, "S:")) != -1) {
+    switch (opt) {
+      case 'S':
+        socket_path = optarg;
+        break;
+      default:
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (argc - optind != 2) {
+    print_usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  int width, height, depth;
+  unsigned char *image = image_read(argv[optind], &width, &height, &depth);
+  if (image == NULL) exit(EXIT_FAILURE);
+  int fd = mosaic_connect(socket_path);
+  if (fd < 0) exit(EXIT_FAILURE);
+
+  double start = timer_now();
+  int status = mosaic_request(fd, image, width, height, image);
+  close(fd);
+  if (status != MOSAIC_OK) {
+    log_error("Request failed with status %d", status);
+    exit(EXIT_FAILURE);
+  }
+  log_info("%dx%d mosaic in %.1f ms", width, height, (timer_now() - start) * 1e3);
+  int failed = image_write(argv[optind + 1], width, height, image);
+  free(image);
+  return failed ? EXIT_FAILURE : 0;
+}
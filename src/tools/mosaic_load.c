@@ -0,0 +1,135 @@
+#define _POSIX_C_SOURCE 200809L
+#include <image.h>
+#include <log/log.h>
+#include <pthread.h>
+#include <server/client.h>
+#include <server/protocol.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <util.h>
+
+typedef struct {
+  const char *socket_path;
+  const unsigned char *image;
+  int width;
+  int height;
+  int num_requests;
+  int next;  // Next request to send, shared by the clients
+  int num_failed;
+  double *latencies;  // Seconds per successful request
+  int num_done;
+  pthread_mutex_t lock;
+} Load;
+
+static void print_usage(const char *prog) {
+  log_error("Usage: %s [options] [input.bmp]", prog);
+  log_error("  -S <path>    socket of the mosaic server (default: %s)", DEFAULT_SOCKET);
+  log_error("  -c <count>   concurrent connections (default: 4)");
+  log_error("  -n <count>   total requests (default: 100)");
+}
+
+/**
+ * One client: a connection that sends requests back to back until the total is reached
+ */
+static void *client_main(void *arg) {
+  Load *load = (Load *)arg;
+  unsigned char *mosaic = (unsigned char *)malloc((size_t)load->width * load->height * 3);
+  int fd = mosaic_connect(load->socket_path);
+  for (;;) {
+    pthread_mutex_lock(&load->lock);
+    int k = load->next < load->num_requests ? load->next++ : -1;
+    pthread_mutex_unlock(&load->lock);
+    if (k < 0) break;
+
+    if (fd < 0) fd = mosaic_connect(load->socket_path);
+    double start = timer_now();
+    int status = fd < 0 ? -1 : mosaic_request(fd, load->image, load->width, load->height, mosaic);
+    double latency = timer_now() - start;
+    pthread_mutex_lock(&load->lock);
+    if (status == MOSAIC_OK) {
+      load->latencies[load->num_done++] = latency;
+    } else {
+      load->num_failed++;
+    }
+    pthread_mutex_unlock(&load->lock);
+    if (status != MOSAIC_OK && fd >= 0) {
+      close(fd);  // The server drops the connection after an error, reconnect for the next one
+      fd = -1;
+    }
+  }
+  if (fd >= 0) close(fd);
+  free(mosaic);
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int count, double p) {
+  if (count == 0) return 0;
+  int k = (int)(p * (count - 1) + 0.5);
+  return sorted[k];
+}
+
+int main(int argc, char **argv) {
+  const char *socket_path = DEFAULT_SOCKET;
+  int concurrency = 4;
+  int num_requests = 100;
+  int opt;
+  while ((opt = getopt(argc, argv, "S:c:n:")) != -1) {
+    switch (opt) {
+      case 'S':
+        socket_path = optarg;
+        break;
+      case 'c':
+        concurrency = atoi(optarg);
+        break;
+      case 'n':
+        num_requests = atoi(optarg);
+        break;
+      default:
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (argc - optind != 1 || concurrency < 1 || num_requests < 1) {
+    print_usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  Load load;
+  memset(&load, 0, sizeof(load));
+  int depth;
+  unsigned char *image = image_read(argv[optind], &load.width, &load.height, &depth);
+  if (image == NULL) exit(EXIT_FAILURE);
+  load.socket_path = socket_path;
+  load.image = image;
+  load.num_requests = num_requests;
+  load.latencies = (double *)malloc(num_requests * sizeof(double));
+  pthread_mutex_init(&load.lock, NULL);
+
+  double start = timer_now();
+  pthread_t *clients = (pthread_t *)malloc(concurrency * sizeof(pthread_t));
+  for (int i = 0; i < concurrency; ++i) pthread_create(&clients[i], NULL, client_main, &load);
+  for (int i = 0; i < concurrency; ++i) pthread_join(clients[i], NULL);
+  double elapsed = timer_now() - start;
+
+  qsort(load.latencies, load.num_done, sizeof(double), compare_doubles);
+  log_info("%d requests of %dx%d over %d connections in %.2f s: %.2f requests/s, %d failed",
+           num_requests, load.width, load.height, concurrency, elapsed, load.num_done / elapsed,
+           load.num_failed);
+  log_info("latency p50 %.1f ms, p95 %.1f ms, p99 %.1f ms, max %.1f ms",
+           percentile(load.latencies, load.num_done, 0.50) * 1e3,
+           percentile(load.latencies, load.num_done, 0.95) * 1e3,
+           percentile(load.latencies, load.num_done, 0.99) * 1e3,
+           load.num_done ? load.latencies[load.num_done - 1] * 1e3 : 0.0);
+
+  pthread_mutex_destroy(&load.lock);
+  free(clients);
+  free(load.latencies);
+  free(image);
+  return load.num_failed == 0 ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,98 @@
+#include "pca.h"
+#include <log/log.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Modified Gram-Schmidt over the columns of the dim x dims matrix v
+ */
+static void orthonormalize(double *v, int dim, int dims) {
+  for (int c = 0; c < dims; ++c) {
+    for (int p = 0; p < c; ++p) {
+      double dot = 0;
+      for (int k = 0; k < dim; ++k) {
+        dot += v[k * dims + c] * v[k * dims + p];
+      }
+      for (int k = 0; k < dim; ++k) {
+        v[k * dims + c] -= dot * v[k * dims + p];
+      }
+    }
+    double norm = 0;
+    for (int k = 0; k < dim; ++k) {
+      norm += v[k * dims + c] * v[k * dims + c];
+    }
+    norm = sqrt(norm);
+    for (int k = 0; k < dim; ++k) {
+      v[k * dims + c] /= norm;
+    }
+  }
+}
+
+void pca_train(const unsigned char *data, int n, int dim, size_t stride, int dims, int iters,
+               float *mean, float *basis) {
+  if (n < dims) {
+    log_error("PCA needs at least %d vectors, got %d", dims, n);
+    exit(EXIT_FAILURE);
+  }
+
+  double *mu = (double *)calloc(dim, sizeof(double));
+  for (int i = 0; i < n; ++i) {
+    for (int k = 0; k < dim; ++k) {
+      mu[k] += data[i * stride + k];
+    }
+  }
+  for (int k = 0; k < dim; ++k) {
+    mu[k] /= n;
+  }
+
+  // v <- X^T X v on the centred samples, without forming the dim x dim covariance
+  double *v = (double *)malloc((size_t)dim * dims * sizeof(double));
+  double *next = (double *)malloc((size_t)dim * dims * sizeof(double));
+  double *z = (double *)malloc((size_t)n * dims * sizeof(double));
+  srand(1);
+  for (int k = 0; k < dim * dims; ++k) {
+    v[k] = (double)rand() / RAND_MAX - 0.5;
+  }
+  orthonormalize(v, dim, dims);
+  for (int it = 0; it < iters; ++it) {
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; ++i) {
+      double *zi = z + (size_t)i * dims;
+      memset(zi, 0, dims * sizeof(double));
+      for (int k = 0; k < dim; ++k) {
+        double x = data[i * stride + k] - mu[k];
+        for (int c = 0; c < dims; ++c) {
+          zi[c] += x * v[k * dims + c];
+        }
+      }
+    }
+#pragma omp parallel for schedule(static)
+    for (int k = 0; k < dim; ++k) {
+      double *row = next + (size_t)k * dims;
+      memset(row, 0, dims * sizeof(double));
+      for (int i = 0; i < n; ++i) {
+        double x = data[i * stride + k] - mu[k];
+        for (int c = 0; c < dims; ++c) {
+          row[c] += x * z[(size_t)i * dims + c];
+        }
+      }
+    }
+    orthonormalize(next, dim, dims);
+    double *tmp = v;
+    v = next;
+    next = tmp;
+    log_debug("[pca] iteration %d/%d", it + 1, iters);
+  }
+
+  for (int k = 0; k < dim; ++k) {
+    mean[k] = mu[k];
+    for (int c = 0; c < dims; ++c) {
+      basis[(size_t)c * dim + k] = v[k * dims + c];
+    }
+  }
+  free(mu);
+  free(v);
+  free(next);
+  free(z);
+}
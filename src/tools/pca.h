@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Top principal components of uint8 vectors by subspace iteration
+ * @param data first vector; vector i starts at data + i * stride
+ * @param n number of vectors used for training
+ * @param mean output buffer of dim floats
+ * @param basis output buffer of dims * dim floats, one orthonormal component per row
+ */
+void pca_train(const unsigned char *data, int n, int dim, size_t stride, int dims, int iters,
+               float *mean, float *basis);
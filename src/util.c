@@ -1,18 +1,31 @@
 #include "util.h"
 #include <log/log.h>
+#include <pthread.h>
 #include <sys/time.h>
 
 static double _start_time[256];
 static int _p = -1;
 
-static double get_time() {
+double timer_now() {
   struct timeval tv;
   gettimeofday(&tv, 0);
   return tv.tv_sec + tv.tv_usec * 1e-6;
 }
 
-void timer_start() { _start_time[++_p] = get_time(); }
+void timer_start() { _start_time[++_p] = timer_now(); }
 
-double timer_stop() { return get_time() - _start_time[_p--]; }
+double timer_stop() { return timer_now() - _start_time[_p--]; }
 
 void timer_stop_and_log(const char *name) { log_debug("%s: %lf", name, timer_stop()); }
+
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void log_lock(void *udata, int lock) {
+  if (lock) {
+    pthread_mutex_lock(&log_mutex);
+  } else {
+    pthread_mutex_unlock(&log_mutex);
+  }
+}
+
+void log_use_mutex() { log_set_lock(log_lock); }
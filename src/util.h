@@ -1,5 +1,15 @@
 #pragma once
 
+/**
+ * Wall-clock seconds; unlike the timer stack it is safe to call from any thread
+ */
+double timer_now();
+
 void timer_start();
 double timer_stop();
 void timer_stop_and_log(const char *name);
+
+/**
+ * Serialise log output with a mutex, for the modes that log from several threads
+ */
+void log_use_mutex();